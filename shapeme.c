@@ -31,6 +31,18 @@
 #include <math.h>
 #include <time.h>
 #include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
 #define PNG_DEBUG 3
 #include <png.h>
 #include <SDL.h>
@@ -41,11 +53,66 @@
 #define MINALPHA 1
 #define MAXALPHA 100
 
+#define METRIC_EUCLIDEAN 0  /* Sum of the RGB distances of the pixels. */
+#define METRIC_SSE 1        /* Sum of the squared RGB distances. */
+
+#define INITIAL_TEMPERATURE 0.10
+
+#define SCHEDULE_LINEAR 0       /* Temperature lowered by a fixed step. */
+#define SCHEDULE_EXPONENTIAL 1  /* Halved every 'opt_halflife' generations. */
+#define SCHEDULE_TIME 2         /* Halved every 'opt_halflife' milliseconds. */
+#define SCHEDULE_ACCEPTANCE 3   /* Tuned to get 'opt_target_acceptance'. */
+
+#define PLATEAU_REHEAT 1        /* Raise the temperature again. */
+#define PLATEAU_JUMP 2          /* Continue from the absolute best. */
+
+#define SCHED_FIXED 0       /* Fixed probabilities of the mutation kinds. */
+#define SCHED_ADAPTIVE 1    /* Probabilities adapted to the payoff. */
+
 /* Configurable options. */
 int opt_use_triangles = 1;
 int opt_use_circles = 0;
 int opt_restart = 0;
 int opt_mutation_rate = 200;
+int opt_scheduler = SCHED_FIXED;
+int opt_schedule = SCHEDULE_LINEAR;
+char *opt_halflife = NULL;  /* Generations or time, depending on schedule. */
+long long opt_halflife_value = 0;
+float opt_target_acceptance = 0.05;
+long long opt_plateau_generations = 0; /* Plateau length, 0 = never. */
+int opt_plateau_action = PLATEAU_JUMP;
+float opt_reheat_temperature = 0.01;
+int opt_snapshot_every = 0; /* 0 means: select it automatically. */
+int opt_metric = METRIC_EUCLIDEAN;
+char *opt_simd = "auto";
+int opt_threads = 1;
+int opt_band_threads = 1;
+int opt_headless = 0;
+int opt_fps = 30;
+unsigned long long opt_seed = 0;
+int opt_seed_given = 0;
+int opt_bench = 0;          /* Generations to run in benchmark mode. */
+int opt_batch = 0;          /* Evolving a batch of images. */
+int opt_jobs = 0;           /* Images evolved in parallel, 0 = automatic. */
+float opt_target_diff = 0;  /* Batch jobs stop at this diff, 0 = never. */
+long long opt_time_budget = 0; /* Batch jobs stop after it (ms), 0 = never. */
+int opt_sequence = 0;       /* Evolving a sequence of frames. */
+int opt_first_frame = -1;   /* Number of the first frame, -1 = 0 or 1. */
+long long opt_frame_generations = 20000; /* Generations for every frame. */
+int opt_tiles = 0;          /* Size of the tiles in tiled mode, 0 = off. */
+int opt_tile_overlap = 16;  /* Pixels of the neighbours evolved with a tile. */
+int opt_pyramid = 1;        /* Number of resolution levels, 1 = disabled. */
+char *opt_level_generations = "50000"; /* Per level, see listValue(). */
+char *opt_level_plateau = "5000";
+long long opt_checkpoint_interval = 5000; /* Milliseconds between saves. */
+char *opt_stats = NULL;     /* File where to append statistics, or NULL. */
+int opt_max_size = 0;       /* Downsample larger images, 0 = never. */
+char *opt_journal = NULL;   /* Journal of the improvements, or NULL. */
+long long opt_journal_max_size = 0; /* Compact the journal beyond it. */
+int opt_journal_dump = 0;   /* Just print the journal history. */
+long long opt_stats_interval = 1000; /* Milliseconds between statistics. */
+int opt_islands = 1;        /* Number of independent chains, see evolveIslands(). */
+long long opt_migration_interval = 10000;
 
 /* The global state defines the global state we save and restore
  * in addition to the best candidate. */
@@ -56,9 +123,20 @@ struct globalState {
     long long generation;
 } state;
 
+/* A rectangle is used to track the area of the image touched by a mutation,
+ * and to clip drawing operations. Coordinates are inclusive. */
+struct rect {
+    int x0, y0, x1, y1;
+};
+
 /* Internally we represent our set of trinagels as an array of the triangle
  * structures. While the structure is named "trinalge" if type is TYPE_CIRCLE
- * it actually represents a circle. */
+ * it actually represents a circle.
+ *
+ * Besides the shape, the structure caches its bounding box, that is checked
+ * against the clipping rectangle every time the shape could be drawn:
+ * shapeSetup() must be called every time the coordinates are modified,
+ * normalize() already does it. */
 struct triangle {
     int type;
     unsigned char r,g,b,alpha;
@@ -70,6 +148,7 @@ struct triangle {
             short x1,y1,radius;
         } c;
     } u;
+    struct rect box;            /* Bounding box, see shapeRect(). */
 };
 
 struct triangles {
@@ -78,8 +157,178 @@ struct triangles {
     int inuse;
 };
 
-/* SDL initialization function. */
-static SDL_Texture *sdlInit(int width, int height, int fullscreen, SDL_Renderer **rp) {
+/* A mutation describes how a candidate differs from the best solution it
+ * was derived from. Mutations are applied in place to the set of shapes,
+ * logging the old value of every modified or deleted shape in the undo
+ * log, so that a rejected mutation can be reverted without keeping a copy
+ * of the whole set. */
+#define UNDO_SET 0      /* Shape 'idx' was modified. */
+#define UNDO_DELETE 1   /* Shape 'idx' was deleted. */
+#define MAX_UNDO 16     /* More than mutatetriangles() can log. */
+
+/* Kinds of mutation, tracked to report how often every kind of mutation
+ * leads to an accepted or improving candidate. */
+#define MUT_ADD 0           /* A shape was added. */
+#define MUT_REMOVE 1        /* A shape was removed. */
+#define MUT_SWAP 2          /* Two shapes were swapped. */
+#define MUT_VERTEXES 3      /* mutatetriangle() choices, from 0 to 5. */
+#define MUT_MOVE_BIG 4
+#define MUT_MOVE_SMALL 5
+#define MUT_COLOR 6
+#define MUT_COLOR_DELTA 7
+#define MUT_ALPHA 8
+#define MUT_KINDS 9
+
+char *mutationKindNames[MUT_KINDS] = {
+    "add", "remove", "swap", "vertexes", "move_big", "move_small",
+    "color", "color_delta", "alpha"
+};
+
+struct undo {
+    int op;
+    int idx;
+    struct triangle old;
+};
+
+struct mutation {
+    struct rect dirty;  /* Area of the image touched by the mutation. */
+    int minidx;         /* Lowest index of a modified shape. */
+    int maxidx;         /* Highest index of a modified shape. */
+    int oldinuse;       /* Shapes in use before the mutation. */
+    int undolen;        /* Number of entries of the undo log. */
+    int kinds;          /* Bitmap of the MUT_* kinds of the mutation. */
+    struct undo undo[MAX_UNDO];
+};
+
+/* Blending parameters of a shape, computed once every time the shape is
+ * drawn. Blending uses 8.8 fixed point math, and the reference formula,
+ * implemented by spanScalar(), for every channel of every pixel is:
+ *
+ *     a = (alpha*256+50)/100              (alpha from 1 to 100)
+ *     p = (p*(256-a) + color*a + 128) >> 8
+ *
+ * All the span kernels must produce exactly the same output, so that a
+ * given set of shapes always renders to the same image. */
+struct blend {
+    int inva;                   /* 256 - quantized alpha. */
+    unsigned short c[3];        /* color*a + 128, for R, G, B. */
+    unsigned short pattern[48]; /* 'c' repeated, for 16 pixels. */
+};
+
+/* The evaluator caches the rendering of the current best solution, and the
+ * difference with the target image split into square tiles of TILE_SIZE
+ * pixels. This way a candidate that only changed a few shapes can be scored
+ * by redrawing and diffing just the tiles covering the changed area.
+ *
+ * Every candidate has its own framebuffer, that is always identical to
+ * 'bestfb' except for the area 'stale': this is the area of the candidates
+ * evaluated so far and not yet restored from 'bestfb', or the area changed
+ * by other accepted candidates. It is restored just before the next
+ * evaluation, so that multiple candidates can be scored concurrently.
+ *
+ * Since blending is order dependent, a mutation of the shape at index 'j'
+ * can't change the composition of the shapes below it. So the evaluator
+ * also takes a snapshot of the partial rendering of the best solution every
+ * 'snapevery' shapes: a candidate is drawn starting from the nearest
+ * snapshot below the lowest modified shape instead of from a black image.
+ *
+ * For very large images the work of a single candidate can be split into
+ * horizontal bands of tiles, every band drawn and compared by a different
+ * thread of the candidate 'bands' pool. */
+#define TILE_SIZE 32
+#define BAND_MIN_PIXELS 65536   /* Don't split smaller areas into bands. */
+#define MAX_BAND_THREADS 64
+#define MAX_SNAPSHOTS 8
+#define MIN_SNAPSHOT_EVERY 8
+
+/* Pseudo random numbers generator, xoshiro128** by Blackman and Vigna.
+ * The state is explicitly passed to every function needing random numbers:
+ * every thread owns a different stream, so that threads never contend for
+ * a shared state, and a run is reproducible given the same seed. */
+struct rng {
+    uint32_t s[4];
+};
+
+/* Time spent in the different phases of the evolution, in microseconds.
+ * When the work is split into bands, the time of every band is summed. */
+struct timing {
+    long long mutate;           /* Copying and mutating the best solution. */
+    long long draw;             /* Rendering shapes, snapshots included. */
+    long long diff;             /* Comparing with the target image. */
+    long long pixels;           /* Pixels blended while rendering shapes. */
+};
+
+struct candidate {
+    struct triangles *triangles; /* Mutated copy of the best solution. */
+    struct mutation m;          /* How it differs from the best solution. */
+    unsigned char *fb;          /* Rendering of the candidate solution. */
+    long long *tilediff;        /* Per tile diff of 'fb', valid in 'dirty'. */
+    long long diff;             /* Total diff of the candidate. */
+    struct rect dirty;          /* Tile aligned area of the last evaluation. */
+    struct rect stale;          /* Area of 'fb' to restore from 'bestfb'. */
+    struct pool *bands;         /* Threads to split the work into bands. */
+    struct timing timing;       /* Time spent on this candidate. */
+    struct rng rng;             /* Random stream of the thread using it. */
+    long long evaltime;         /* Time to generate and evaluate it, in us. */
+};
+
+struct evaluator {
+    unsigned char *image;       /* The target image. */
+    int width, height;
+    struct triangles *best;     /* The accepted solution. */
+    unsigned char *bestfb;      /* Rendering of the accepted solution. */
+    int tilesx, tilesy;         /* Number of tiles per row and per column. */
+    long long *tilediff;        /* Per tile diff of 'bestfb' VS 'image'. */
+    long long diff;             /* Sum of all the 'tilediff' entries. */
+    int numcand;                /* Number of candidates per generation. */
+    int maxinuse;               /* Max shapes the candidates can use. */
+    long long limit;            /* Candidates with a greater diff would be
+                                   rejected anyway: stop comparing them. */
+    struct scheduler *sched;    /* Adaptive mutations scheduler, or NULL. */
+    struct candidate **cand;    /* Candidates, one per thread. */
+    int snapevery;              /* Shapes between snapshots, 0 = disabled. */
+    int snapcount;              /* Number of allocated snapshots. */
+    int snapvalid;              /* Snapshots in sync with the best solution. */
+    int snapinuse;              /* Shapes in use when snapshots were taken. */
+    unsigned char **snap;       /* snap[i] = shapes 0..(i+1)*snapevery-1 */
+};
+
+/* A pool of threads running the same function with different ids. The
+ * thread calling poolRun() runs the job with id 0 itself. */
+struct pool {
+    int size;                   /* Number of threads, including the caller. */
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    void (*func)(void *arg, int id);
+    void *arg;
+    long long round;            /* Incremented every time a job starts. */
+    int pending;                /* Threads that didn't finish the job. */
+    int stop;                   /* Threads should exit, see poolFree(). */
+};
+
+/* The work of drawing and comparing an area of the image, split into
+ * horizontal bands processed in parallel. See renderArea(). */
+struct bandJob {
+    struct evaluator *ev;
+    unsigned char *fb;          /* Destination framebuffer. */
+    unsigned char *base;        /* Framebuffer to start from, NULL = black. */
+    struct rect area;           /* Area to render. */
+    struct triangles *t;        /* Shapes to draw. */
+    int start, end;             /* Range of shapes to draw. */
+    long long *tilediff;        /* Where to store tiles diff, or NULL. */
+    long long budget;           /* Stop comparing a band above this diff. */
+    int bands;                  /* Number of bands. */
+    long long diff[MAX_BAND_THREADS]; /* Diff of every band. */
+    int timed;                  /* Measure the time of every band. */
+    long long drawtime[MAX_BAND_THREADS], difftime[MAX_BAND_THREADS];
+    long long pixels[MAX_BAND_THREADS];
+};
+
+/* SDL initialization function. On success the window and the renderer are
+ * stored at 'wp' and 'rp', and must be released with sdlClose(). On error
+ * everything is released and NULL is returned. */
+static SDL_Texture *sdlInit(int width, int height, int fullscreen, SDL_Window **wp, SDL_Renderer **rp) {
     int flags = SDL_WINDOW_OPENGL;
     SDL_Window *screen;
     SDL_Renderer *renderer;
@@ -90,19 +339,21 @@ static SDL_Texture *sdlInit(int width, int height, int fullscreen, SDL_Renderer
         fprintf(stderr, "SDL Init error: %s\n", SDL_GetError());
         return NULL;
     }
-    atexit(SDL_Quit);
     screen = SDL_CreateWindow("Shapeme",
                               SDL_WINDOWPOS_UNDEFINED,
                               SDL_WINDOWPOS_UNDEFINED,
                               width,height,flags);
     if (!screen) {
         fprintf(stderr, "Can't create SDL window: %s\n", SDL_GetError());
+        SDL_Quit();
         return NULL;
     }
 
     renderer = SDL_CreateRenderer(screen,-1,0);
     if (!renderer) {
         fprintf(stderr, "Can't create SDL renderer: %s\n", SDL_GetError());
+        SDL_DestroyWindow(screen);
+        SDL_Quit();
         return NULL;
     }
 
@@ -111,12 +362,24 @@ static SDL_Texture *sdlInit(int width, int height, int fullscreen, SDL_Renderer
                                 width,height);
     if (!texture) {
         fprintf(stderr, "Can't create SDL texture: %s\n", SDL_GetError());
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(screen);
+        SDL_Quit();
         return NULL;
     }
+    *wp = screen;
     *rp = renderer;
     return texture;
 }
 
+/* Release what sdlInit() created, and shut down SDL. */
+static void sdlClose(SDL_Window *screen, SDL_Renderer *renderer, SDL_Texture *texture) {
+    SDL_DestroyTexture(texture);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(screen);
+    SDL_Quit();
+}
+
 /* Show a raw RGB image on the SDL screen. */
 static void sdlShowRgb(SDL_Texture *texture, SDL_Renderer *renderer, unsigned char *fb, int width,
         int height)
@@ -128,8 +391,9 @@ static void sdlShowRgb(SDL_Texture *texture, SDL_Renderer *renderer, unsigned ch
     SDL_RenderPresent(renderer);
 }
 
-/* Minimal SDL event processing, just a few keys to exit the program. */
-static void processSdlEvents(void) {
+/* Minimal SDL event processing, just a few keys to exit the program.
+ * Return 1 if the user asked to exit, otherwise 0. */
+static int processSdlEvents(void) {
     SDL_Event event;
 
     while(SDL_PollEvent(&event)) {
@@ -138,12 +402,205 @@ static void processSdlEvents(void) {
             switch(event.key.keysym.sym) {
             case SDLK_q:
             case SDLK_ESCAPE:
-                exit(0);
-                break;
+                return 1;
             default: break;
             }
         }
     }
+    return 0;
+}
+
+/* Return the UNIX time in microseconds / milliseconds. */
+long long ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+long long mstime(void) {
+    return ustime()/1000;
+}
+
+/* The viewer shows the evolving image in an SDL window. SDL must only be
+ * used by the main thread, so when the viewer is enabled the evolution runs
+ * in a different thread, see viewerRun(), while the main thread owns the
+ * window and processes its events. The evolution never waits for the
+ * renderer: it publishes the best rendering with viewerUpdate(), that at
+ * most 'fps' times per second copies it into the viewer buffer, and never
+ * blocks on the viewer lock. */
+struct viewer {
+    pthread_mutex_t lock;
+    int width, height, fps;     /* The size is zero until viewerOpen(). */
+    unsigned char *fb;          /* Last published frame. */
+    long long version;          /* Incremented at every published frame. */
+    int pending;                /* There is a newer frame to publish. */
+    long long lastpub;          /* Time of the last published frame, in ms. */
+    void (*func)(void *arg);    /* The evolution run by viewerRun(). */
+    void *arg;
+    int done;                   /* 'func' returned. */
+};
+
+struct viewer *viewerCreate(int fps) {
+    struct viewer *v = malloc(sizeof(*v));
+
+    v->width = 0;
+    v->height = 0;
+    v->fps = (fps > 0) ? fps : 1;
+    v->fb = NULL;
+    v->version = 0;
+    v->pending = 0;
+    v->lastpub = mstime();
+    v->done = 0;
+    pthread_mutex_init(&v->lock,NULL);
+    return v;
+}
+
+void viewerFree(struct viewer *v) {
+    if (v == NULL) return;
+    pthread_mutex_destroy(&v->lock);
+    free(v->fb);
+    free(v);
+}
+
+/* Open the window of the viewer, of the size of the target 'image', that is
+ * shown for one second before the frames published with viewerUpdate().
+ * Does nothing if 'v' is NULL. */
+void viewerOpen(struct viewer *v, unsigned char *image, int width, int height) {
+    if (v == NULL) return;
+    pthread_mutex_lock(&v->lock);
+    v->fb = malloc(width*height*3);
+    memcpy(v->fb,image,width*height*3);
+    v->width = width;
+    v->height = height;
+    v->version++;
+    pthread_mutex_unlock(&v->lock);
+}
+
+void *viewerThread(void *arg) {
+    struct viewer *v = arg;
+
+    v->func(v->arg);
+    pthread_mutex_lock(&v->lock);
+    v->done = 1;
+    pthread_mutex_unlock(&v->lock);
+    return NULL;
+}
+
+/* Call func(arg). If 'v' is not NULL, that must be called by the main
+ * thread, 'func' runs in a new thread, while the calling thread shows the
+ * window opened by viewerOpen() until 'func' returns, then closes it. If
+ * the window can't be created the evolution continues without it. When
+ * the user asks to exit, SDL is shut down and the program exits. */
+void viewerRun(struct viewer *v, void (*func)(void *arg), void *arg) {
+    pthread_t thread;
+    SDL_Window *screen = NULL;
+    SDL_Renderer *renderer = NULL;
+    SDL_Texture *texture = NULL;
+    unsigned char *frame = NULL;
+    long long shown = 0;
+    int width, height, done;
+
+    if (v == NULL) {
+        func(arg);
+        return;
+    }
+    v->func = func;
+    v->arg = arg;
+    if (pthread_create(&thread,NULL,viewerThread,v) != 0) {
+        perror("Creating the evolution thread");
+        exit(1);
+    }
+
+    while(1) {
+        pthread_mutex_lock(&v->lock);
+        done = v->done;
+        width = v->width;
+        height = v->height;
+        pthread_mutex_unlock(&v->lock);
+        if (done) break;
+        if (width && texture == NULL) {
+            texture = sdlInit(width,height,0,&screen,&renderer);
+            if (!texture) {
+                fprintf(stderr,"No display available, evolving without it.\n");
+                /* Nobody will show the frames: stop publishing them. */
+                pthread_mutex_lock(&v->lock);
+                v->width = v->height = 0;
+                pthread_mutex_unlock(&v->lock);
+                break;
+            }
+            frame = malloc(width*height*3);
+        }
+        if (texture) {
+            if (processSdlEvents()) {
+                sdlClose(screen,renderer,texture);
+                exit(0);
+            }
+            pthread_mutex_lock(&v->lock);
+            if (v->version != shown) {
+                int first = (shown == 0);
+
+                memcpy(frame,v->fb,width*height*3);
+                shown = v->version;
+                pthread_mutex_unlock(&v->lock);
+                sdlShowRgb(texture,renderer,frame,width,height);
+                /* Show the target image for one second. */
+                if (first) SDL_Delay(1000);
+            } else {
+                pthread_mutex_unlock(&v->lock);
+            }
+        }
+        SDL_Delay(1000/v->fps);
+    }
+    pthread_join(thread,NULL);
+    if (texture) sdlClose(screen,renderer,texture);
+    free(frame);
+}
+
+/* Publish the frame 'fb' if 'changed' is true or if a previous frame could
+ * not be published yet. This is called at every generation, and only
+ * copies the frame if enough time elapsed since the last one and the
+ * viewer is not busy copying it, otherwise it is retried later.
+ *
+ * The frame may be smaller than the window, as it happens while evolving
+ * the coarse levels of the pyramid: in that case it is scaled up. */
+void viewerUpdate(struct viewer *v, unsigned char *fb, int width, int height, int changed) {
+    long long now;
+    int x, y;
+
+    if (v == NULL) return;
+    if (changed) v->pending = 1;
+    if (!v->pending) return;
+    now = mstime();
+    if (now - v->lastpub < 1000/v->fps) return;
+    if (pthread_mutex_trylock(&v->lock) != 0) return;
+    if (v->width == 0) {
+        /* Not opened yet, or there is no display. */
+        pthread_mutex_unlock(&v->lock);
+        v->pending = 0;
+        v->lastpub = now;
+        return;
+    }
+    if (width == v->width && height == v->height) {
+        memcpy(v->fb,fb,v->width*v->height*3);
+    } else {
+        for (y = 0; y < v->height; y++) {
+            unsigned char *src = fb+(y*height/v->height)*width*3;
+            unsigned char *dst = v->fb+y*v->width*3;
+
+            for (x = 0; x < v->width; x++) {
+                unsigned char *p = src+(x*width/v->width)*3;
+
+                *dst++ = p[0];
+                *dst++ = p[1];
+                *dst++ = p[2];
+            }
+        }
+    }
+    v->version++;
+    pthread_mutex_unlock(&v->lock);
+    v->pending = 0;
+    v->lastpub = now;
 }
 
 /* Write a PNG file. The image is passed with row_pointers as an RGB image. */
@@ -181,19 +638,28 @@ int PngWrite(FILE *fp, int width, int height, png_bytep *row_pointers)
 
 /* Load a PNG and returns it as a raw RGB representation, as an array of bytes.
  * As a side effect the function populates widthptr, heigthptr with the
- * size of the image in pixel. The integer pointed by alphaptr is set to one.
- * if the image is of type RGB_ALPHA, otherwise it's set to zero.
+ * size of the image in pixel. The integer pointed by alphaptr is set to one
+ * if the image has an alpha channel, otherwise it's set to zero.
+ *
+ * Any PNG is accepted: palette, grayscale and 16 bit images are converted
+ * by libpng while decoding, and the alpha channel is discarded. Rows are
+ * decoded one after the other directly into the returned buffer, so the
+ * decoded image is never held twice in memory.
  *
- * This function is able to load both RGB and RGBA images, but it will always
- * return data as RGB, discarding the alpha channel. */
+ * If 'maxsize' is not zero and the image is larger than 'maxsize' pixels in
+ * some dimension, it is downsampled while decoding, averaging blocks of
+ * NxN pixels, with N the smallest integer that makes it fit. */
 #define PNG_BYTES_TO_CHECK 8
-unsigned char *PngLoad(FILE *fp, int *widthptr, int *heightptr, int *alphaptr) {
+unsigned char *PngLoad(FILE *fp, int *widthptr, int *heightptr, int *alphaptr, int maxsize) {
     unsigned char buf[PNG_BYTES_TO_CHECK];
     png_structp png_ptr;
     png_infop info_ptr;
-    png_uint_32 width, height, j;
-    int color_type, row_bytes;
-    unsigned char **imageData, *rgb;
+    png_uint_32 width, height, j, i;
+    int color_type, bit_depth, interlaced, passes, pass, k;
+    unsigned char * volatile rgb = NULL;
+    unsigned char * volatile row = NULL;
+    unsigned long long * volatile sums = NULL;
+    unsigned int f, w, h, y;
 
     /* Check signature */
     if (fread(buf, 1, PNG_BYTES_TO_CHECK, fp) != PNG_BYTES_TO_CHECK)
@@ -218,6 +684,9 @@ unsigned char *PngLoad(FILE *fp, int *widthptr, int *heightptr, int *alphaptr) {
     if (setjmp(png_jmpbuf(png_ptr)))
     {
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        free(rgb);
+        free(row);
+        free(sums);
         return NULL;
     }
 
@@ -227,53 +696,172 @@ unsigned char *PngLoad(FILE *fp, int *widthptr, int *heightptr, int *alphaptr) {
     /* Undo the fact that we read some data to detect the PNG file */
     png_set_sig_bytes(png_ptr, PNG_BYTES_TO_CHECK);
 
-    /* Read the PNG in memory at once */
-    png_read_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
-
-    /* Get image info */
+    /* Get image info, and ask libpng to convert everything to 8 bit RGB. */
+    png_read_info(png_ptr, info_ptr);
     width = png_get_image_width(png_ptr, info_ptr);
     height = png_get_image_height(png_ptr, info_ptr);
     color_type = png_get_color_type(png_ptr, info_ptr);
-    if (color_type != PNG_COLOR_TYPE_RGB &&
-        color_type != PNG_COLOR_TYPE_RGB_ALPHA) {
-        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-        return NULL;
-    }
+    bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    interlaced = png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE;
+    *alphaptr = (color_type & PNG_COLOR_MASK_ALPHA) ||
+                png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS);
 
-    /* Get the image data */
-    imageData = png_get_rows(png_ptr, info_ptr);
-    row_bytes = png_get_rowbytes(png_ptr, info_ptr);
-    rgb = malloc(row_bytes*height);
-    if (!rgb) {
+    if (color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(png_ptr);
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+        png_set_expand_gray_1_2_4_to_8(png_ptr);
+    if (bit_depth == 16)
+        png_set_strip_16(png_ptr);
+    /* Palette images with a tRNS chunk are expanded to RGBA. */
+    if (*alphaptr)
+        png_set_strip_alpha(png_ptr);
+    if (color_type == PNG_COLOR_TYPE_GRAY ||
+        color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+        png_set_gray_to_rgb(png_ptr);
+    passes = png_set_interlace_handling(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
+    if (png_get_rowbytes(png_ptr, info_ptr) != width*3) {
         png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
         return NULL;
     }
 
-    for (j = 0; j < height; j++) {
-        unsigned char *dst = rgb+(j*width*3);
-        unsigned char *src = imageData[j];
-        unsigned int i;
+    /* Downsampling factor. */
+    f = 1;
+    if (maxsize > 0)
+        while ((width+f-1)/f > (unsigned)maxsize ||
+               (height+f-1)/f > (unsigned)maxsize) f++;
+    w = (width+f-1)/f;
+    h = (height+f-1)/f;
+
+    if (f == 1 || interlaced) {
+        /* Interlaced images can only be decoded all at once: use the
+         * output buffer for the full image, and downsample it later. */
+        rgb = malloc((size_t)width*height*3);
+        if (!rgb) png_error(png_ptr, "Out of memory");
+        for (pass = 0; pass < passes; pass++)
+            for (j = 0; j < height; j++)
+                png_read_row(png_ptr, rgb+(size_t)j*width*3, NULL);
+        if (f > 1) {
+            for (y = 0; y < h; y++) {
+                for (i = 0; i < w; i++) {
+                    unsigned long long s[3] = {0,0,0}, n = 0;
+                    unsigned int x, yy;
+
+                    for (yy = y*f; yy < (y+1)*f && yy < height; yy++) {
+                        for (x = i*f; x < (i+1)*f && x < width; x++) {
+                            unsigned char *p = rgb+((size_t)yy*width+x)*3;
+                            s[0] += p[0]; s[1] += p[1]; s[2] += p[2];
+                            n++;
+                        }
+                    }
+                    /* The output pixel is always before the input ones. */
+                    for (k = 0; k < 3; k++)
+                        rgb[((size_t)y*w+i)*3+k] = (s[k]+n/2)/n;
+                }
+            }
+            rgb = realloc(rgb,(size_t)w*h*3);
+        }
+    } else {
+        /* Sum every row into the output row it belongs to, and write the
+         * averages every 'f' rows. */
+        rgb = malloc((size_t)w*h*3);
+        row = malloc((size_t)width*3);
+        sums = malloc(sizeof(unsigned long long)*w*3);
+        if (!rgb || !row || !sums) png_error(png_ptr, "Out of memory");
+        for (y = 0; y < h; y++) {
+            unsigned int rows = 0;
+
+            memset(sums,0,sizeof(unsigned long long)*w*3);
+            for (j = y*f; j < (y+1)*f && j < height; j++) {
+                png_read_row(png_ptr, row, NULL);
+                for (i = 0; i < width; i++)
+                    for (k = 0; k < 3; k++) sums[(i/f)*3+k] += row[i*3+k];
+                rows++;
+            }
+            for (i = 0; i < w; i++) {
+                unsigned long long n = (unsigned long long)rows*
+                    ((i+1)*f <= width ? f : width-i*f);
 
-        for (i = 0; i < width; i++) {
-            dst[0] = src[0];
-            dst[1] = src[1];
-            dst[2] = src[2];
-            dst += 3;
-            src += (color_type == PNG_COLOR_TYPE_RGB_ALPHA) ? 4 : 3;
+                for (k = 0; k < 3; k++)
+                    rgb[((size_t)y*w+i)*3+k] = (sums[i*3+k]+n/2)/n;
+            }
         }
+        free(row);
+        free(sums);
     }
+    png_read_end(png_ptr, NULL);
 
     /* Free the image and resources and return */
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-    *widthptr = width;
-    *heightptr = height;
-    *alphaptr = (color_type == PNG_COLOR_TYPE_RGB_ALPHA);
+    if (f > 1)
+        printf("Image %ux%u downsampled by %u\n", width, height, f);
+    *widthptr = w;
+    *heightptr = h;
     return rgb;
 }
 
+/* Splitmix64, only used to expand a seed into a generator state. */
+uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Initialize the stream 'stream' of the generator for the given seed.
+ * Different streams of the same seed are statistically independent. */
+void rngSeed(struct rng *r, uint64_t seed, uint64_t stream) {
+    uint64_t x = seed ^ (stream * 0xd1b54a32d192ed03ULL);
+    uint64_t a = splitmix64(&x), b = splitmix64(&x);
+
+    r->s[0] = a; r->s[1] = a >> 32;
+    r->s[2] = b; r->s[3] = b >> 32;
+    if ((r->s[0]|r->s[1]|r->s[2]|r->s[3]) == 0) r->s[0] = 1;
+}
+
+static inline uint32_t rotl32(uint32_t x, int k) {
+    return (x << k) | (x >> (32-k));
+}
+
+/* Return 32 random bits. */
+uint32_t rngNext(struct rng *r) {
+    uint32_t *s = r->s;
+    uint32_t result = rotl32(s[1]*5,7)*9;
+    uint32_t t = s[1] << 9;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl32(s[3],11);
+    return result;
+}
+
+/* Return a random number in the range 0..n-1, without the bias of the
+ * modulo operation (Lemire's multiply and reject method). */
+uint32_t rngBelow(struct rng *r, uint32_t n) {
+    uint64_t m = (uint64_t)rngNext(r) * n;
+    uint32_t low = (uint32_t)m;
+
+    if (low < n) {
+        uint32_t threshold = -n % n;
+        while (low < threshold) {
+            m = (uint64_t)rngNext(r) * n;
+            low = (uint32_t)m;
+        }
+    }
+    return m >> 32;
+}
+
+/* Return a random float in the range [0,1). */
+float rngFloat(struct rng *r) {
+    return (rngNext(r) >> 8) * (1.0f/16777216);
+}
+
 /* Return a random number between the internal specified (including min and max) */
-int randbetween(int min, int max) {
-    return min+(random()%(max-min+1));
+int randbetween(struct rng *rng, int min, int max) {
+    return min+rngBelow(rng,max-min+1);
 }
 
 /* When we mutate a triangle, or create a random one, it is possible that the
@@ -336,20 +924,24 @@ void normalizeCircle(struct triangle *r, int width, int height) {
     r->u.c.radius = radius;
 }
 
-/* Calls triangle or circle normalization functions according to the type. */
+void shapeSetup(struct triangle *t);
+
+/* Calls triangle or circle normalization functions according to the type,
+ * then updates the drawing data of the shape. */
 void normalize(struct triangle *r, int width, int height) {
     if (r->type == TYPE_TRIANGLE)
         normalizeTriangle(r,width,height);
     else
         normalizeCircle(r,width,height);
+    shapeSetup(r);
 }
 
 /* Triangle or circle? */
-int selectShapeType(void) {
+int selectShapeType(struct rng *rng) {
     int triangle;
 
     if (opt_use_circles && opt_use_triangles) {
-        triangle = random()&1;
+        triangle = rngNext(rng)&1;
     } else if (opt_use_circles) {
         triangle = 0;
     } else {
@@ -359,99 +951,98 @@ int selectShapeType(void) {
 }
 
 /* Set random RGB and alpha. */
-void setRandomColor(struct triangle *r) {
-    r->r = random()%256;
-    r->g = random()%256;
-    r->b = random()%256;
-    r->alpha = randbetween(MINALPHA,MAXALPHA);
+void setRandomColor(struct rng *rng, struct triangle *r) {
+    r->r = rngBelow(rng,256);
+    r->g = rngBelow(rng,256);
+    r->b = rngBelow(rng,256);
+    r->alpha = randbetween(rng,MINALPHA,MAXALPHA);
 }
 
 /* Set random triangle vertexes or circle center and radius. */
-void setRandomVertexes(struct triangle *r, int width, int height) {
+void setRandomVertexes(struct rng *rng, struct triangle *r, int width, int height) {
     if (r->type == TYPE_TRIANGLE) {
-        r->u.t.x1 = random()%width;
-        r->u.t.y1 = random()%height;
-        r->u.t.x2 = random()%width;
-        r->u.t.y2 = random()%height;
-        r->u.t.x3 = random()%width;
-        r->u.t.y3 = random()%height;
+        r->u.t.x1 = rngBelow(rng,width);
+        r->u.t.y1 = rngBelow(rng,height);
+        r->u.t.x2 = rngBelow(rng,width);
+        r->u.t.y2 = rngBelow(rng,height);
+        r->u.t.x3 = rngBelow(rng,width);
+        r->u.t.y3 = rngBelow(rng,height);
     } else {
-        r->u.c.x1 = random()%width;
-        r->u.c.y1 = random()%height;
-        r->u.c.radius = random()%width;
+        r->u.c.x1 = rngBelow(rng,width);
+        r->u.c.y1 = rngBelow(rng,height);
+        r->u.c.radius = rngBelow(rng,width);
     }
 }
 
 /* Translate vertexes at random, from -delta to delta. */
-void moveVertexes(struct triangle *t, int delta) {
+void moveVertexes(struct rng *rng, struct triangle *t, int delta) {
     if (t->type == TYPE_TRIANGLE) {
-        t->u.t.x1 += randbetween(-delta,delta);
-        t->u.t.y1 += randbetween(-delta,delta);
-        t->u.t.x2 += randbetween(-delta,delta);
-        t->u.t.y2 += randbetween(-delta,delta);
-        t->u.t.x3 += randbetween(-delta,delta);
-        t->u.t.y3 += randbetween(-delta,delta);
+        t->u.t.x1 += randbetween(rng,-delta,delta);
+        t->u.t.y1 += randbetween(rng,-delta,delta);
+        t->u.t.x2 += randbetween(rng,-delta,delta);
+        t->u.t.y2 += randbetween(rng,-delta,delta);
+        t->u.t.x3 += randbetween(rng,-delta,delta);
+        t->u.t.y3 += randbetween(rng,-delta,delta);
     } else {
-        t->u.c.x1 += randbetween(-delta,delta);
-        t->u.c.y1 += randbetween(-delta,delta);
-        t->u.c.radius += randbetween(-delta,delta);
+        t->u.c.x1 += randbetween(rng,-delta,delta);
+        t->u.c.y1 += randbetween(rng,-delta,delta);
+        t->u.c.radius += randbetween(rng,-delta,delta);
     }
 }
 
 /* Create a random triangle or circle. */
-void randomtriangle(struct triangle *r, int width, int height) {
-    r->type = selectShapeType();
-    setRandomVertexes(r,width,height);
-    setRandomColor(r);
+void randomtriangle(struct rng *rng, struct triangle *r, int width, int height) {
+    r->type = selectShapeType(rng);
+    setRandomVertexes(rng,r,width,height);
+    setRandomColor(rng,r);
     normalize(r,width,height);
 }
 
 /* Like randomtriangle() but vertex/radius can't be more than 'delta' pixel
  * away from initial random coordinates. */
-void randomsmalltriangle(struct triangle *r, int width, int height, int delta) {
-    int x = random()%width;
-    int y = random()%height;
+void randomsmalltriangle(struct rng *rng, struct triangle *r, int width, int height, int delta) {
+    int x = rngBelow(rng,width);
+    int y = rngBelow(rng,height);
 
-    r->type = selectShapeType();
+    r->type = selectShapeType(rng);
     if (r->type == TYPE_TRIANGLE) {
-        r->u.t.x1 = x + randbetween(-delta,delta);
-        r->u.t.y1 = y + randbetween(-delta,delta);
-        r->u.t.x2 = x + randbetween(-delta,delta);
-        r->u.t.y2 = y + randbetween(-delta,delta);
-        r->u.t.x3 = x + randbetween(-delta,delta);
-        r->u.t.y3 = y + randbetween(-delta,delta);
+        r->u.t.x1 = x + randbetween(rng,-delta,delta);
+        r->u.t.y1 = y + randbetween(rng,-delta,delta);
+        r->u.t.x2 = x + randbetween(rng,-delta,delta);
+        r->u.t.y2 = y + randbetween(rng,-delta,delta);
+        r->u.t.x3 = x + randbetween(rng,-delta,delta);
+        r->u.t.y3 = y + randbetween(rng,-delta,delta);
     } else {
         r->u.c.x1 = x;
         r->u.c.y1 = y;
-        r->u.c.radius = randbetween(1,delta);
+        r->u.c.radius = randbetween(rng,1,delta);
     }
-    setRandomColor(r);
+    setRandomColor(rng,r);
     normalize(r,width,height);
 }
 
-/* Apply a random mutation to the specified triangle/circle. */
-void mutatetriangle(struct triangle *t, int width, int height) {
-    int choice = random() % 6;
-
+/* Apply the mutation 'choice', from 0 to 5, to the specified triangle or
+ * circle. */
+void mutateShape(struct rng *rng, struct triangle *t, int width, int height, int choice) {
     if (choice == 0) {
-        setRandomVertexes(t,width,height);
+        setRandomVertexes(rng,t,width,height);
         normalize(t,width,height);
     } else if (choice == 1) {
-        moveVertexes(t,20);
+        moveVertexes(rng,t,20);
         normalize(t,width,height);
     } else if (choice == 2) {
-        moveVertexes(t,5);
+        moveVertexes(rng,t,5);
         normalize(t,width,height);
     } else if (choice == 3) {
-        t->r = random()%256;
-        t->g = random()%256;
-        t->b = random()%256;
+        t->r = rngBelow(rng,256);
+        t->g = rngBelow(rng,256);
+        t->b = rngBelow(rng,256);
     } else if (choice == 4) {
         int r,g,b;
 
-        r = t->r + randbetween(-5,5);
-        g = t->g + randbetween(-5,5);
-        b = t->b + randbetween(-5,5);
+        r = t->r + randbetween(rng,-5,5);
+        g = t->g + randbetween(rng,-5,5);
+        b = t->b + randbetween(rng,-5,5);
         if (r < 0) r = 0;
         else if (r > 255) r = 255;
         if (g < 0) g = 0;
@@ -462,12 +1053,21 @@ void mutatetriangle(struct triangle *t, int width, int height) {
         t->g = g;
         t->b = b;
     } else if (choice == 5) {
-        t->alpha = randbetween(MINALPHA,MAXALPHA);
+        t->alpha = randbetween(rng,MINALPHA,MAXALPHA);
     }
 }
 
+/* Apply a random mutation to the specified triangle/circle. The kind of
+ * mutation applied, from 0 to 5, is returned. */
+int mutatetriangle(struct rng *rng, struct triangle *t, int width, int height) {
+    int choice = rngBelow(rng,6);
+
+    mutateShape(rng,t,width,height,choice);
+    return choice;
+}
+
 /* Create a set of trinalges and populate it with random triangles. */
-struct triangles *mkRandomtriangles(int count, int width, int height) {
+struct triangles *mkRandomtriangles(struct rng *rng, int count, int width, int height) {
     struct triangles *rs;
     int j;
 
@@ -477,69 +1077,375 @@ struct triangles *mkRandomtriangles(int count, int width, int height) {
     rs->triangles = malloc(sizeof(struct triangle)*count);
     for (j = 0; j < count; j++) {
         struct triangle *r = &rs->triangles[j];
-        randomtriangle(r,width,height);
+        randomtriangle(rng,r,width,height);
     }
     return rs;
 }
 
-/* Draw a prixel in an RGB framebuffer. */
-void setPixelWithAlpha(unsigned char *fb, int x, int y, int width, int height, int r, int g, int b, float alpha) {
-    unsigned char *p = fb+y*width*3+x*3;
+/* Release a set of triangles created with mkRandomtriangles(). */
+void freeTriangles(struct triangles *rs) {
+    free(rs->triangles);
+    free(rs);
+}
+
+/* Scale the coordinates of all the triangles/circles of the set by the
+ * specified factor, normalizing them for an image of the specified size. */
+void scaleTriangles(struct triangles *rs, float factor, int width, int height) {
+    int j;
+
+    for (j = 0; j < rs->count; j++) {
+        struct triangle *t = &rs->triangles[j];
+
+        if (t->type == TYPE_TRIANGLE) {
+            t->u.t.x1 *= factor; t->u.t.y1 *= factor;
+            t->u.t.x2 *= factor; t->u.t.y2 *= factor;
+            t->u.t.x3 *= factor; t->u.t.y3 *= factor;
+        } else {
+            t->u.c.x1 *= factor; t->u.c.y1 *= factor;
+            t->u.c.radius *= factor;
+        }
+        normalize(t,width,height);
+    }
+}
+
+/* Translate all the triangles/circles of the set by 'dx','dy'. */
+void translateTriangles(struct triangles *rs, int dx, int dy) {
+    int j;
+
+    for (j = 0; j < rs->inuse; j++) {
+        struct triangle *t = &rs->triangles[j];
+
+        if (t->type == TYPE_TRIANGLE) {
+            t->u.t.x1 += dx; t->u.t.y1 += dy;
+            t->u.t.x2 += dx; t->u.t.y2 += dy;
+            t->u.t.x3 += dx; t->u.t.y3 += dy;
+        } else {
+            t->u.c.x1 += dx; t->u.c.y1 += dy;
+        }
+        shapeSetup(t);
+    }
+}
+
+/* Set the rectangle to the empty rectangle, that is, the one that once
+ * merged with another rectangle with rectUnion() leaves it unmodified. */
+void rectReset(struct rect *r) {
+    r->x0 = r->y0 = INT_MAX;
+    r->x1 = r->y1 = INT_MIN;
+}
+
+int rectIsEmpty(struct rect *r) {
+    return r->x0 > r->x1 || r->y0 > r->y1;
+}
+
+/* Enlarge 'dst' so that it also contains 'src'. */
+void rectUnion(struct rect *dst, struct rect *src) {
+    if (src->x0 < dst->x0) dst->x0 = src->x0;
+    if (src->y0 < dst->y0) dst->y0 = src->y0;
+    if (src->x1 > dst->x1) dst->x1 = src->x1;
+    if (src->y1 > dst->y1) dst->y1 = src->y1;
+}
+
+/* Return true if the two rectangles have at least one pixel in common. */
+int rectIntersects(struct rect *a, struct rect *b) {
+    return a->x0 <= b->x1 && b->x0 <= a->x1 &&
+           a->y0 <= b->y1 && b->y0 <= a->y1;
+}
+
+/* Clip the rectangle so that it is fully contained in the image. */
+void rectClip(struct rect *r, int width, int height) {
+    if (r->x0 < 0) r->x0 = 0;
+    if (r->y0 < 0) r->y0 = 0;
+    if (r->x1 >= width) r->x1 = width-1;
+    if (r->y1 >= height) r->y1 = height-1;
+}
+
+/* Compute the bounding box of the specified triangle/circle into 'r'.
+ * The triangle box is enlarged by one pixel to be sure that rounding
+ * errors in the scanline conversion are always inside the box. */
+void computeShapeRect(struct triangle *t, struct rect *r) {
+    if (t->type == TYPE_TRIANGLE) {
+        r->x0 = r->x1 = t->u.t.x1;
+        r->y0 = r->y1 = t->u.t.y1;
+        if (t->u.t.x2 < r->x0) r->x0 = t->u.t.x2;
+        if (t->u.t.x2 > r->x1) r->x1 = t->u.t.x2;
+        if (t->u.t.x3 < r->x0) r->x0 = t->u.t.x3;
+        if (t->u.t.x3 > r->x1) r->x1 = t->u.t.x3;
+        if (t->u.t.y2 < r->y0) r->y0 = t->u.t.y2;
+        if (t->u.t.y2 > r->y1) r->y1 = t->u.t.y2;
+        if (t->u.t.y3 < r->y0) r->y0 = t->u.t.y3;
+        if (t->u.t.y3 > r->y1) r->y1 = t->u.t.y3;
+        r->x0--; r->y0--;
+        r->x1++; r->y1++;
+    } else {
+        r->x0 = t->u.c.x1 - t->u.c.radius;
+        r->x1 = t->u.c.x1 + t->u.c.radius;
+        r->y0 = t->u.c.y1 - t->u.c.radius;
+        r->y1 = t->u.c.y1 + t->u.c.radius;
+    }
+}
+
+/* Compute the cached bounding box of the shape. */
+void shapeSetup(struct triangle *t) {
+    computeShapeRect(t,&t->box);
+}
+
+/* Populate 'r' with the bounding box of the specified triangle/circle. */
+static inline void shapeRect(struct triangle *t, struct rect *r) {
+    *r = t->box;
+}
+
+/* Prepare a mutation structure to be populated by mutatetriangles(). */
+void mutationReset(struct mutation *m, struct triangles *rs) {
+    rectReset(&m->dirty);
+    m->minidx = INT_MAX;
+    m->maxidx = -1;
+    m->oldinuse = rs->inuse;
+    m->undolen = 0;
+    m->kinds = 0;
+}
+
+/* Log the shape at index 'idx' before it is modified or deleted, as
+ * specified by 'op', so that mutationUndo() can restore it. */
+void mutationLog(struct mutation *m, struct triangles *rs, int op, int idx) {
+    struct undo *u = &m->undo[m->undolen++];
+
+    u->op = op;
+    u->idx = idx;
+    u->old = rs->triangles[idx];
+}
+
+/* Revert the mutation 'm' applied to 'rs', replaying the log backward.
+ * Reverting an already reverted mutation does nothing. */
+void mutationUndo(struct mutation *m, struct triangles *rs) {
+    if (m->undolen == 0) return;
+    while (m->undolen) {
+        struct undo *u = &m->undo[--m->undolen];
+
+        if (u->op == UNDO_DELETE) {
+            memmove(rs->triangles+u->idx+1,rs->triangles+u->idx,
+                sizeof(struct triangle)*(rs->inuse-u->idx));
+            rs->inuse++;
+        }
+        rs->triangles[u->idx] = u->old;
+    }
+    rs->inuse = m->oldinuse;
+}
+
+/* Apply the mutation 'm', that turned a set equal to 'dst' into 'src', to
+ * 'dst' as well, copying from 'src' only the range of modified shapes. */
+void mutationCopy(struct mutation *m, struct triangles *dst, struct triangles *src) {
+    int last = (m->maxidx < src->inuse) ? m->maxidx : src->inuse-1;
+
+    if (m->minidx <= last) {
+        memcpy(dst->triangles+m->minidx,src->triangles+m->minidx,
+            sizeof(struct triangle)*(last-m->minidx+1));
+    }
+    dst->inuse = src->inuse;
+}
+
+/* Remember in the mutation that the shape at index 'idx' was modified,
+ * merging its bounding box into the dirty area. */
+void markDirty(struct mutation *m, struct triangles *rs, int idx) {
+    struct rect r;
+
+    shapeRect(&rs->triangles[idx],&r);
+    rectUnion(&m->dirty,&r);
+    if (idx < m->minidx) m->minidx = idx;
+    if (idx > m->maxidx) m->maxidx = idx;
+}
+
+/* Compute the blending parameters for the specified shape. */
+void setupBlend(struct blend *b, struct triangle *t) {
+    int a = (t->alpha*256+50)/100;
+    int j;
+
+    b->inva = 256-a;
+    b->c[0] = t->r*a+128;
+    b->c[1] = t->g*a+128;
+    b->c[2] = t->b*a+128;
+    for (j = 0; j < 48; j++) b->pattern[j] = b->c[j%3];
+}
+
+/* Blend a span of 'pixels' pixels starting at 'p'. This is the reference
+ * implementation of the blending formula. */
+void spanScalar(unsigned char *p, int pixels, struct blend *b) {
+    int inva = b->inva;
+
+    while(pixels--) {
+        p[0] = (p[0]*inva+b->c[0]) >> 8;
+        p[1] = (p[1]*inva+b->c[1]) >> 8;
+        p[2] = (p[2]*inva+b->c[2]) >> 8;
+        p += 3;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+/* SIMD span kernels: bytes are widened to 16 bit words, multiplied by the
+ * inverse alpha and added to the per channel color term. Since the pattern
+ * of channels repeats every 3 bytes, 48 bytes (16 pixels) are processed
+ * at every step, using three different color term vectors. The sum
+ * can't overflow 16 bits since 255*(256-a) + 255*a + 128 < 65536. */
+__attribute__((target("sse2")))
+void spanSSE2(unsigned char *p, int pixels, struct blend *b) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i inva = _mm_set1_epi16(b->inva);
+    __m128i c[6];
+    int j;
+
+    for (j = 0; j < 6; j++) c[j] = _mm_loadu_si128((__m128i*)(b->pattern+j*8));
+    for (; pixels >= 16; pixels -= 16) {
+        for (j = 0; j < 3; j++, p += 16) {
+            __m128i v = _mm_loadu_si128((__m128i*)p);
+            __m128i lo = _mm_unpacklo_epi8(v,zero);
+            __m128i hi = _mm_unpackhi_epi8(v,zero);
+
+            lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(lo,inva),c[j*2]),8);
+            hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(hi,inva),c[j*2+1]),8);
+            _mm_storeu_si128((__m128i*)p,_mm_packus_epi16(lo,hi));
+        }
+    }
+    spanScalar(p,pixels,b);
+}
+
+/* Like spanSSE2() but 96 bytes (32 pixels) at every step. The pack
+ * instruction works inside 128 bit lanes, so a permutation is needed to
+ * put the 64 bit groups of the result back in order. */
+__attribute__((target("avx2")))
+void spanAVX2(unsigned char *p, int pixels, struct blend *b) {
+    const __m256i inva = _mm256_set1_epi16(b->inva);
+    __m256i c[3];
+    int j;
+
+    for (j = 0; j < 3; j++) c[j] = _mm256_loadu_si256((__m256i*)(b->pattern+j*16));
+    for (; pixels >= 32; pixels -= 32) {
+        for (j = 0; j < 3; j++, p += 32) {
+            __m256i lo = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)p));
+            __m256i hi = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)(p+16)));
 
-    if (x < 0 || x >= width || y < 0 || y >= height) return;
-    p[0] = (alpha*r)+((1-alpha)*p[0]);
-    p[1] = (alpha*g)+((1-alpha)*p[1]);
-    p[2] = (alpha*b)+((1-alpha)*p[2]);
+            lo = _mm256_srli_epi16(_mm256_add_epi16(
+                    _mm256_mullo_epi16(lo,inva),c[(j*2)%3]),8);
+            hi = _mm256_srli_epi16(_mm256_add_epi16(
+                    _mm256_mullo_epi16(hi,inva),c[(j*2+1)%3]),8);
+            _mm256_storeu_si256((__m256i*)p,_mm256_permute4x64_epi64(
+                _mm256_packus_epi16(lo,hi),_MM_SHUFFLE(3,1,2,0)));
+        }
+    }
+    spanSSE2(p,pixels,b);
 }
+#endif
 
-/* Draw an horizontal line in an RGB framebuffer. */
-void drawHline(unsigned char *fb, int width, int height, int x1, int x2, int y, int r, int g, int b, float alpha) {
-    int aux, x;
-    unsigned char *p;
-    int ar = alpha*r;
-    int ag = alpha*g;
-    int ab = alpha*b;
-    float invalpha = 1-alpha;
+typedef void spanKernel(unsigned char *p, int pixels, struct blend *b);
+spanKernel *spanKernelFunc = spanScalar;
 
-    if (y < 0 || y >= height) return;
+/* Draw an horizontal line in an RGB framebuffer. Only the part of the line
+ * inside the 'clip' rectangle is drawn. Returns the number of pixels drawn. */
+int drawHline(unsigned char *fb, int width, struct rect *clip, int x1, int x2, int y, struct blend *b) {
+    int aux;
+
+    if (y < clip->y0 || y > clip->y1) return 0;
     if (x1 > x2) {
         aux = x1;
         x1 = x2;
         x2 = aux;
     }
-    p = fb+y*width*3+x1*3;
-    for (x = x1; x <= x2; x++) {
-        p[0] = ar+(invalpha*p[0]);
-        p[1] = ag+(invalpha*p[1]);
-        p[2] = ab+(invalpha*p[2]);
-        p += 3;
+    if (x1 < clip->x0) x1 = clip->x0;
+    if (x2 > clip->x1) x2 = clip->x1;
+    if (x1 > x2) return 0;
+    spanKernelFunc(fb+y*width*3+x1*3,x2-x1+1,b);
+    return x2-x1+1;
+}
+
+/* Circles are drawn using precomputed spans: circleSpans[r][dy] is the
+ * half width of the span at distance 'dy' from the center of a circle of
+ * radius 'r', for every radius up to 'circleSpansMax'. The table takes
+ * about maxradius^2 bytes, and is created once by circleSpansInit(). */
+unsigned short **circleSpans = NULL;
+int circleSpansMax = -1;
+
+/* Half width of the span at distance 'dy' from the center of a circle of
+ * radius 'r'. Since the center has integer coordinates, rounding the half
+ * width is the same as rounding the two span ends. */
+int circleHalfWidth(int r, int dy) {
+    return round(sqrt((double)r*r - (double)dy*dy));
+}
+
+/* Create the spans table for circles up to 'maxradius'. Circles with
+ * greater radius are still drawn, computing the spans on the fly. */
+void circleSpansInit(int maxradius) {
+    unsigned short *buf;
+    int r, dy;
+
+    if (maxradius <= circleSpansMax) return;
+    if (circleSpans) {
+        free(circleSpans[0]);
+        free(circleSpans);
     }
+    buf = malloc(sizeof(unsigned short)*(maxradius+1)*(maxradius+2)/2);
+    circleSpans = malloc(sizeof(unsigned short*)*(maxradius+1));
+    for (r = 0; r <= maxradius; r++) {
+        circleSpans[r] = buf;
+        for (dy = 0; dy <= r; dy++) buf[dy] = circleHalfWidth(r,dy);
+        buf += r+1;
+    }
+    circleSpansMax = maxradius;
 }
 
-/* Draw a circle in an RGB framebuffer. */
-void drawCircle(unsigned char *fb, int width, int height, struct triangle *c)
+/* Draw a circle in an RGB framebuffer. The clipping rectangle is applied
+ * once: only the rows inside it are visited, and the horizontal clipping is
+ * skipped at all if the circle is horizontally inside the rectangle.
+ * Returns the number of pixels drawn. */
+int drawCircle(unsigned char *fb, int width, struct rect *clip, struct triangle *c)
 {
-    int x1, x2, y;
+    int x1, x2, y, y0, y1, h, pixels = 0;
     int xc, yc, r;
+    unsigned short *span;
+    unsigned char *row;
+    struct blend b;
 
     xc = c->u.c.x1;
     yc = c->u.c.y1;
     r = c->u.c.radius;
+    if (r < 0 || xc+r < clip->x0 || xc-r > clip->x1) return 0;
+    y0 = (yc-r < clip->y0) ? clip->y0 : yc-r;
+    y1 = (yc+r > clip->y1) ? clip->y1 : yc+r;
+    if (y0 > y1) return 0;
+    setupBlend(&b,c);
+    span = (r <= circleSpansMax) ? circleSpans[r] : NULL;
 
-    for (y=yc-r; y<=yc+r; y++) {
-        x1 = round(xc + sqrt((r*r) - ((y - yc)*(y - yc))));
-        x2 = round(xc - sqrt((r*r) - ((y - yc)*(y - yc))));
-        drawHline(fb,width,height,x1,x2,y,c->r,c->g,c->b,(float)c->alpha/100);
+    row = fb+y0*width*3;
+    if (xc-r >= clip->x0 && xc+r <= clip->x1) {
+        for (y = y0; y <= y1; y++, row += width*3) {
+            h = span ? span[abs(y-yc)] : circleHalfWidth(r,y-yc);
+            spanKernelFunc(row+(xc-h)*3,h*2+1,&b);
+            pixels += h*2+1;
+        }
+    } else {
+        for (y = y0; y <= y1; y++, row += width*3) {
+            h = span ? span[abs(y-yc)] : circleHalfWidth(r,y-yc);
+            x1 = xc-h;
+            x2 = xc+h;
+            if (x1 < clip->x0) x1 = clip->x0;
+            if (x2 > clip->x1) x2 = clip->x1;
+            if (x1 <= x2) {
+                spanKernelFunc(row+x1*3,x2-x1+1,&b);
+                pixels += x2-x1+1;
+            }
+        }
     }
+    return pixels;
 }
 
-/* Draw a triangle in an RGB framebuffer. */
-void drawTriangle(unsigned char *fb, int width, int height, struct triangle *r) {
+/* Draw a triangle in an RGB framebuffer. Returns the number of pixels
+ * drawn. */
+int drawTriangle(unsigned char *fb, int width, struct rect *clip, struct triangle *r) {
     struct {
         float x, y;
     } A, B, C, E, S;
-    float dx1,dx2,dx3;
+    float dx1, dx2, dx3;
+    struct blend b;
+    int pixels = 0;
 
+    setupBlend(&b,r);
     A.x = r->u.t.x1;
     A.y = r->u.t.y1;
     B.x = r->u.t.x2;
@@ -551,224 +1457,3309 @@ void drawTriangle(unsigned char *fb, int width, int height, struct triangle *r)
     if (C.y-A.y > 0) dx2=(C.x-A.x)/(C.y-A.y); else dx2=0;
     if (C.y-B.y > 0) dx3=(C.x-B.x)/(C.y-B.y); else dx3=0;
 
+    /* Rows below the clipping rectangle are never visited. The ones above
+     * it must still be stepped, to accumulate the same rounding errors. */
+    if (C.y > clip->y1) C.y = clip->y1;
+    if (B.y > C.y) B.y = C.y;
+
     S=E=A;
     if(dx1 > dx2) {
         for(;S.y<=B.y;S.y++,E.y++,S.x+=dx2,E.x+=dx1)
-            drawHline(fb,width,height,S.x,E.x,S.y,r->r,r->g,r->b,(float)r->alpha/100);
-        E=B;
-        E.y+=1;
+            pixels += drawHline(fb,width,clip,S.x,E.x,S.y,&b);
+        E.x=r->u.t.x2;
+        E.y=r->u.t.y2+1;
         for(;S.y<=C.y;S.y++,E.y++,S.x+=dx2,E.x+=dx3)
-            drawHline(fb,width,height,S.x,E.x,S.y,r->r,r->g,r->b,(float)r->alpha/100);
+            pixels += drawHline(fb,width,clip,S.x,E.x,S.y,&b);
     } else {
         for(;S.y<=B.y;S.y++,E.y++,S.x+=dx1,E.x+=dx2)
-            drawHline(fb,width,height,S.x,E.x,S.y,r->r,r->g,r->b,(float)r->alpha/100);
-        S=B;
-        S.y+=1;
+            pixels += drawHline(fb,width,clip,S.x,E.x,S.y,&b);
+        S.x=r->u.t.x2;
+        S.y=r->u.t.y2+1;
         for(;S.y<=C.y;S.y++,E.y++,S.x+=dx3,E.x+=dx2)
-            drawHline(fb,width,height,S.x,E.x,S.y,r->r,r->g,r->b,(float)r->alpha/100);
+            pixels += drawHline(fb,width,clip,S.x,E.x,S.y,&b);
     }
+    return pixels;
 }
 
-/* Draw a set of trinalges/circles in an RGB framebuffer. */
-void drawtriangles(unsigned char *fb, int width, int height, struct triangles *r) {
+/* Draw the shapes from index 'start' to 'end' (excluded) of a set of
+ * trinalges/circles in an RGB framebuffer. Only the shapes intersecting the
+ * 'clip' rectangle are drawn, and only inside it. Returns the number of
+ * pixels drawn. */
+long long drawtrianglesRange(unsigned char *fb, int width, struct rect *clip, struct triangles *r, int start, int end) {
+    long long pixels = 0;
     int j;
 
-    for (j = 0; j < r->inuse; j++) {
+    if (end > r->inuse) end = r->inuse;
+    for (j = start; j < end; j++) {
+        struct rect box;
+
+        shapeRect(&r->triangles[j],&box);
+        if (!rectIntersects(&box,clip)) continue;
         if (r->triangles[j].type == TYPE_TRIANGLE)
-            drawTriangle(fb,width,height,&r->triangles[j]);
+            pixels += drawTriangle(fb,width,clip,&r->triangles[j]);
         else
-            drawCircle(fb,width,height,&r->triangles[j]);
+            pixels += drawCircle(fb,width,clip,&r->triangles[j]);
     }
+    return pixels;
+}
+
+/* Draw a full set of trinalges/circles in an RGB framebuffer. */
+void drawtriangles(unsigned char *fb, int width, struct rect *clip, struct triangles *r) {
+    drawtrianglesRange(fb,width,clip,r,0,r->inuse);
 }
 
-/* Compute the difference between two RGB frame buffers.
+/* Compute the difference between two RGB frame buffers of 'pixels' pixels.
  * The differece is the sum of the differences of every pixel at the same
  * coordinates in the two images.
  *
  * A single pixel difference is computed as spacial distance between the RGB
- * color space. */
-long long computeDiff(unsigned char *a, unsigned char *b, int width, int height) {
+ * color space, truncated to an integer, or as the squared distance if
+ * 'squared' is true (METRIC_SSE).
+ *
+ * This is the reference implementation: the other kernels must return
+ * exactly the same result. The distance is computed in single precision
+ * since for all the possible squared distances (0 to 3*255^2) the
+ * truncated float square root is the same as the double one. */
+long long diffScalar(unsigned char *a, unsigned char *b, int pixels, int squared) {
     int j;
     long long d = 0;
-    long long dr, dg, db;
 
-    for (j = 0; j < width*height*3; j+=3) {
-        dr = (int)a[j]-(int)b[j];
-        dg = (int)a[j+1]-(int)b[j+1];
-        db = (int)a[j+2]-(int)b[j+2];
-        d += sqrt(dr*dr+dg*dg+db*db);
+    for (j = 0; j < pixels*3; j+=3) {
+        int dr = (int)a[j]-(int)b[j];
+        int dg = (int)a[j+1]-(int)b[j+1];
+        int db = (int)a[j+2]-(int)b[j+2];
+        int sq = dr*dr+dg*dg+db*db;
+
+        d += squared ? sq : (int)sqrtf(sq);
     }
     return d;
 }
 
-/* Apply a mutation to a set of triangles. */
-void mutatetriangles(struct triangles *rs, int count, int width, int height) {
+#ifdef HAVE_X86_SIMD
+/* SIMD kernels. All of them work the same way: the absolute difference of
+ * the two images is computed byte by byte, then groups of four pixels
+ * (12 bytes) are moved into 128 bit lanes, and shuffled so that the R and G
+ * differences of every pixel end in a couple of 16 bit words and the B
+ * difference in another. A multiply-add of such vectors by themselves
+ * produces the squared distance of every pixel as a 32 bit integer.
+ *
+ * Sums are accumulated in 32 bit lanes, and flushed into the 64 bit result
+ * every DIFF_FLUSH iterations so that they can't overflow even with the
+ * squared metric. The pixels not filling a whole vector are handled by
+ * the scalar kernel. */
+#define DIFF_FLUSH 8192
+#define SHUF_RG 0,-1,1,-1,3,-1,4,-1,6,-1,7,-1,9,-1,10,-1
+#define SHUF_B 2,-1,-1,-1,5,-1,-1,-1,8,-1,-1,-1,11,-1,-1,-1
+
+/* Sum the 32 bit lanes of an accumulator stored in memory. */
+static inline long long sumLanes(int *lanes, int count) {
+    long long sum = 0;
     int j;
 
-    /* Add a new triangle? */
-    if ((random() % 10) == 0) {
-        if (rs->inuse != rs->count &&
-            rs->inuse < state.max_shapes_incremental)
-        {
-            int r = random() % 5;
-            if (r == 0) {
-                randomtriangle(&rs->triangles[rs->inuse],width,height);
-            } else if (r == 1) {
-                randomsmalltriangle(&rs->triangles[rs->inuse],width,height,5);
-            } else if (r == 2) {
-                randomsmalltriangle(&rs->triangles[rs->inuse],width,height,10);
-            } else if (r == 3) {
-                randomsmalltriangle(&rs->triangles[rs->inuse],width,height,25);
-            } else if (r == 4) {
-                randomsmalltriangle(&rs->triangles[rs->inuse],width,height,2);
-            }
-            rs->inuse++;
-            return;
-        }
-    }
+    for (j = 0; j < count; j++) sum += lanes[j];
+    return sum;
+}
 
-    /* Remove a triangle? */
-    if ((random() % 20) == 0) {
-        if (rs->inuse > 1) {
-            int delidx = random() % rs->inuse;
+/* Load 12 bytes without reading past them. */
+static inline __m128i load12(unsigned char *p) {
+    int last;
 
-            rs->inuse--;
-            memmove(rs->triangles+delidx,rs->triangles+delidx+1,sizeof(struct triangle)*(rs->inuse-delidx));
-            return;
-        }
-    }
+    memcpy(&last,p+8,sizeof(last));
+    return _mm_unpacklo_epi64(_mm_loadl_epi64((__m128i*)p),
+                              _mm_cvtsi32_si128(last));
+}
 
-    /* Swap two triangles */
-    if ((random() % 20) == 0) {
-        int a, b;
-        a = random()%rs->inuse;
-        b = random()%rs->inuse;
-        if (a != b) {
-            struct triangle aux;
+__attribute__((target("ssse3")))
+long long diffSSSE3(unsigned char *a, unsigned char *b, int pixels, int squared) {
+    const __m128i rg = _mm_setr_epi8(SHUF_RG);
+    const __m128i bl = _mm_setr_epi8(SHUF_B);
+    long long d = 0;
+    int j = 0;
 
-            aux = rs->triangles[a];
-            rs->triangles[a] = rs->triangles[b];
-            rs->triangles[b] = aux;
-        }
-    }
+    while (pixels-j >= 4) {
+        __m128i acc = _mm_setzero_si128();
+        int lanes[4], iter = 0;
 
-    /* Mutate every single triangle. */
-    for (j = 0; j < count; j++) {
-        struct triangle *r = &rs->triangles[random()%rs->inuse];
-        if (random() % 1000 < opt_mutation_rate) mutatetriangle(r,width,height);
+        for (; pixels-j >= 4 && iter < DIFF_FLUSH; j += 4, iter++) {
+            __m128i va = load12(a+j*3), vb = load12(b+j*3), c, sq;
+
+            va = _mm_or_si128(_mm_subs_epu8(va,vb),_mm_subs_epu8(vb,va));
+            c = _mm_shuffle_epi8(va,rg);
+            sq = _mm_madd_epi16(c,c);
+            c = _mm_shuffle_epi8(va,bl);
+            sq = _mm_add_epi32(sq,_mm_madd_epi16(c,c));
+            if (!squared)
+                sq = _mm_cvttps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(sq)));
+            acc = _mm_add_epi32(acc,sq);
+        }
+        _mm_storeu_si128((__m128i*)lanes,acc);
+        d += sumLanes(lanes,4);
     }
+    return d + diffScalar(a+j*3,b+j*3,pixels-j,squared);
 }
 
-/* Save a set of triangles as SVG. */
-void saveSvg(char *filename,struct triangles *triangles, int width, int height) {
-    FILE *fp = fopen(filename,"w");
-    int j;
+__attribute__((target("avx2")))
+long long diffAVX2(unsigned char *a, unsigned char *b, int pixels, int squared) {
+    const __m256i rg = _mm256_setr_epi8(SHUF_RG,SHUF_RG);
+    const __m256i bl = _mm256_setr_epi8(SHUF_B,SHUF_B);
+    /* Load 24 bytes and move the second group of 12 in the high lane. */
+    const __m256i mask = _mm256_setr_epi32(-1,-1,-1,-1,-1,-1,0,0);
+    const __m256i perm = _mm256_setr_epi32(0,1,2,7,3,4,5,7);
+    long long d = 0;
+    int j = 0;
 
-    fprintf(fp,"<?xml version=\"1.0\" standalone=\"no\"?><!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.1//EN\" \"http://www.w3.org/Graphics/SVG/1.1/DTD/svg11.dtd\"><svg width=\"100%%\" height=\"100%%\" style=\"background-color:#000000;\" version=\"1.1\" xmlns=\"http://www.w3.org/2000/svg\">\n");
-    fprintf(fp,"<polygon points=\"0,0 %d,0 %d,%d 0,%d\" style=\"fill:#000000;stroke:#000000;stroke-width:0;fill-opacity:1;\"/>\n",width-1,width-1,height-1,height-1);
-    for(j=0;j<triangles->inuse;j++) {
-        struct triangle *t = &triangles->triangles[j];
-        if (t->type == TYPE_TRIANGLE) {
-            fprintf(fp,"<polygon points=\"%d,%d %d,%d %d,%d\" style=\"fill:#%02x%02x%02x;stroke:#000000;stroke-width:0;fill-opacity:%.2f;\"/>\n",t->u.t.x1,t->u.t.y1,t->u.t.x2,t->u.t.y2,t->u.t.x3,t->u.t.y3,t->r,t->g,t->b,(float)t->alpha/100);
-        } else if (t->type == TYPE_CIRCLE) {
-            fprintf(fp,"<circle cx=\"%d\" cy=\"%d\" r=\"%d\" style=\"fill:#%02x%02x%02x;stroke:#000000;stroke-width:0;fill-opacity:%.2f;\"/>\n",t->u.c.x1,t->u.c.y1,t->u.c.radius,t->r,t->g,t->b,(float)t->alpha/100);
+    while (pixels-j >= 8) {
+        __m256i acc = _mm256_setzero_si256();
+        int lanes[8], iter = 0;
+
+        for (; pixels-j >= 8 && iter < DIFF_FLUSH; j += 8, iter++) {
+            __m256i va = _mm256_maskload_epi32((int*)(a+j*3),mask);
+            __m256i vb = _mm256_maskload_epi32((int*)(b+j*3),mask);
+            __m256i c, sq;
+
+            va = _mm256_or_si256(_mm256_subs_epu8(va,vb),
+                                 _mm256_subs_epu8(vb,va));
+            va = _mm256_permutevar8x32_epi32(va,perm);
+            c = _mm256_shuffle_epi8(va,rg);
+            sq = _mm256_madd_epi16(c,c);
+            c = _mm256_shuffle_epi8(va,bl);
+            sq = _mm256_add_epi32(sq,_mm256_madd_epi16(c,c));
+            if (!squared)
+                sq = _mm256_cvttps_epi32(_mm256_sqrt_ps(_mm256_cvtepi32_ps(sq)));
+            acc = _mm256_add_epi32(acc,sq);
         }
+        _mm256_storeu_si256((__m256i*)lanes,acc);
+        d += sumLanes(lanes,8);
     }
-    fprintf(fp,"</svg>\n");
-    fclose(fp);
+    return d + diffScalar(a+j*3,b+j*3,pixels-j,squared);
 }
 
-/* Save a binary representation of a set of triangles and the program state. */
-void saveBinary(char *filename,struct triangles *triangles) {
-    FILE *fp = fopen(filename,"wb");
+__attribute__((target("avx512f,avx512bw")))
+long long diffAVX512(unsigned char *a, unsigned char *b, int pixels, int squared) {
+    const __m512i rg = _mm512_broadcast_i32x4(_mm_setr_epi8(SHUF_RG));
+    const __m512i bl = _mm512_broadcast_i32x4(_mm_setr_epi8(SHUF_B));
+    /* Load 48 bytes and move every group of 12 in its own lane. */
+    const __mmask64 mask = 0xffffffffffffULL;
+    const __m512i perm = _mm512_setr_epi32(0,1,2,15,3,4,5,15,
+                                           6,7,8,15,9,10,11,15);
+    long long d = 0;
+    int j = 0;
 
-    if (!fp) {
-        perror("opening binary file");
-        exit(1);
+    while (pixels-j >= 16) {
+        __m512i acc = _mm512_setzero_si512();
+        int lanes[16], iter = 0;
+
+        for (; pixels-j >= 16 && iter < DIFF_FLUSH; j += 16, iter++) {
+            __m512i va = _mm512_maskz_loadu_epi8(mask,a+j*3);
+            __m512i vb = _mm512_maskz_loadu_epi8(mask,b+j*3);
+            __m512i c, sq;
+
+            va = _mm512_or_si512(_mm512_subs_epu8(va,vb),
+                                 _mm512_subs_epu8(vb,va));
+            va = _mm512_permutexvar_epi32(perm,va);
+            c = _mm512_shuffle_epi8(va,rg);
+            sq = _mm512_madd_epi16(c,c);
+            c = _mm512_shuffle_epi8(va,bl);
+            sq = _mm512_add_epi32(sq,_mm512_madd_epi16(c,c));
+            if (!squared)
+                sq = _mm512_cvttps_epi32(_mm512_sqrt_ps(_mm512_cvtepi32_ps(sq)));
+            acc = _mm512_add_epi32(acc,sq);
+        }
+        _mm512_storeu_si512(lanes,acc);
+        d += sumLanes(lanes,16);
+    }
+    return d + diffScalar(a+j*3,b+j*3,pixels-j,squared);
+}
+#endif
+
+/* SIMD levels, from the slowest to the fastest. The kernels used are the
+ * fastest ones not above the level selected at startup. */
+#define SIMD_SCALAR 0
+#define SIMD_SSE2 1
+#define SIMD_SSSE3 2
+#define SIMD_AVX2 3
+#define SIMD_AVX512 4
+
+struct simdLevelInfo {
+    char *name;
+    char *cpufeature; /* As in __builtin_cpu_supports(), NULL if none. */
+} simdLevels[] = {
+    {"scalar", NULL},
+    {"sse2", "sse2"},
+    {"ssse3", "ssse3"},
+    {"avx2", "avx2"},
+    {"avx512", "avx512bw"}
+};
+
+typedef long long diffKernel(unsigned char *a, unsigned char *b, int pixels, int squared);
+
+struct diffKernelInfo {
+    int level;
+    diffKernel *kernel;
+} diffKernels[] = {
+#ifdef HAVE_X86_SIMD
+    {SIMD_AVX512, diffAVX512},
+    {SIMD_AVX2, diffAVX2},
+    {SIMD_SSSE3, diffSSSE3},
+#endif
+    {SIMD_SCALAR, diffScalar}
+};
+
+struct spanKernelInfo {
+    int level;
+    spanKernel *kernel;
+} spanKernels[] = {
+#ifdef HAVE_X86_SIMD
+    {SIMD_AVX2, spanAVX2},
+    {SIMD_SSE2, spanSSE2},
+#endif
+    {SIMD_SCALAR, spanScalar}
+};
+
+diffKernel *diffKernelFunc = diffScalar;
+char *diffKernelName = "scalar";
+char *spanKernelName = "scalar";
+
+/* Return true if the CPU has the specified feature. */
+int cpuSupports(char *feature) {
+    if (feature == NULL) return 1;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (!strcmp(feature,"avx512bw"))
+        return __builtin_cpu_supports("avx512f") &&
+               __builtin_cpu_supports("avx512bw");
+    if (!strcmp(feature,"avx2")) return __builtin_cpu_supports("avx2");
+    if (!strcmp(feature,"ssse3")) return __builtin_cpu_supports("ssse3");
+    if (!strcmp(feature,"sse2")) return __builtin_cpu_supports("sse2");
+#endif
+    return 0;
+}
+
+/* Check that a kernel produces exactly the same result as the scalar one,
+ * for both metrics, using buffers of many different lengths including the
+ * worst case pixel differences. Return 1 on success, 0 on failure. */
+int checkDiffKernel(diffKernel *kernel) {
+    unsigned char a[3*67], b[3*67];
+    struct rng rng;
+    int j, len;
+
+    rngSeed(&rng,0,0);
+    for (j = 0; j < (int)sizeof(a); j++) {
+        a[j] = (j < 30) ? 255 : rngBelow(&rng,256);
+        b[j] = (j < 30) ? (j&1)*255 : rngBelow(&rng,256);
+    }
+    for (len = 0; len <= 67; len++) {
+        if (kernel(a,b,len,0) != diffScalar(a,b,len,0) ||
+            kernel(a,b,len,1) != diffScalar(a,b,len,1)) return 0;
+    }
+    return 1;
+}
+
+/* Check that a span kernel blends exactly like the scalar one, for spans
+ * of many different lengths and the extreme alpha values.
+ * Return 1 on success, 0 on failure. */
+int checkSpanKernel(spanKernel *kernel) {
+    unsigned char a[3*100], b[3*100];
+    struct triangle t;
+    struct blend bl;
+    struct rng rng;
+    int j, len;
+
+    rngSeed(&rng,0,0);
+    for (len = 0; len <= 100; len++) {
+        t.r = rngBelow(&rng,256);
+        t.g = rngBelow(&rng,256);
+        t.b = rngBelow(&rng,256);
+        t.alpha = (len < 2) ? len*MAXALPHA : randbetween(&rng,MINALPHA,MAXALPHA);
+        setupBlend(&bl,&t);
+        for (j = 0; j < (int)sizeof(a); j++) a[j] = b[j] = rngBelow(&rng,256);
+        kernel(a,len,&bl);
+        spanScalar(b,len,&bl);
+        if (memcmp(a,b,sizeof(a))) return 0;
+    }
+    return 1;
+}
+
+/* Select the SIMD kernels to use. 'name' is either "auto", to select the
+ * fastest kernels supported by this CPU, or the name of a SIMD level.
+ * Kernels failing the consistency check with the scalar ones are skipped.
+ * Return 0 on success, -1 if the requested level is not available. */
+int selectKernels(char *name) {
+    int j, level = -1;
+
+    for (j = 0; j < (int)(sizeof(simdLevels)/sizeof(simdLevels[0])); j++) {
+        if (!cpuSupports(simdLevels[j].cpufeature)) continue;
+        if (!strcmp(name,"auto") || !strcmp(name,simdLevels[j].name))
+            level = j;
+    }
+    if (level == -1) return -1;
+
+    for (j = 0; j < (int)(sizeof(diffKernels)/sizeof(diffKernels[0])); j++) {
+        struct diffKernelInfo *k = &diffKernels[j];
+
+        if (k->level > level) continue;
+        if (!checkDiffKernel(k->kernel)) {
+            fprintf(stderr,"Warning: %s diff kernel failed the consistency "
+                           "check, not using it.\n", simdLevels[k->level].name);
+            continue;
+        }
+        diffKernelFunc = k->kernel;
+        diffKernelName = simdLevels[k->level].name;
+        break;
+    }
+    for (j = 0; j < (int)(sizeof(spanKernels)/sizeof(spanKernels[0])); j++) {
+        struct spanKernelInfo *k = &spanKernels[j];
+
+        if (k->level > level) continue;
+        if (!checkSpanKernel(k->kernel)) {
+            fprintf(stderr,"Warning: %s span kernel failed the consistency "
+                           "check, not using it.\n", simdLevels[k->level].name);
+            continue;
+        }
+        spanKernelFunc = k->kernel;
+        spanKernelName = simdLevels[k->level].name;
+        break;
+    }
+    return 0;
+}
+
+/* Compute the difference between two RGB frame buffers using the selected
+ * kernel and metric. */
+long long computeDiff(unsigned char *a, unsigned char *b, int width, int height) {
+    return diffKernelFunc(a,b,width*height,opt_metric == METRIC_SSE);
+}
+
+/* Convert a diff into a percentage of the max possible diff for an image
+ * of the specified size. The magic constant 442 is actually the max
+ * difference between two pixels as r,g,b coordinates in the space, so
+ * sqrt(255^2*3), rounded up. */
+float diffToPerc(long long diff, int width, int height) {
+    double maxdiff = (opt_metric == METRIC_SSE) ? 255*255*3 : 442;
+
+    return (double)diff/((double)width*height*maxdiff)*100;
+}
+
+/* Return the max diff that converted with diffToPerc() is certainly less
+ * than the percentage 'perc': used to stop the evaluation of candidates
+ * that can't be accepted. A small margin accounts for rounding errors. */
+long long percToDiff(float perc, int width, int height) {
+    double maxdiff = (opt_metric == METRIC_SSE) ? 255*255*3 : 442;
+
+    if (perc >= 100) return LLONG_MAX;
+    return perc/100*((double)width*height*maxdiff)*(1+1e-5)+1;
+}
+
+/* Main function of the pool threads: wait for a new round to start, run
+ * the job, and signal when done. */
+void *poolThread(void *arg) {
+    struct pool *p = arg;
+    long long round = 0;
+    int id;
+
+    pthread_mutex_lock(&p->lock);
+    id = p->pending++; /* poolCreate() starts with pending = 1. */
+    pthread_cond_signal(&p->done);
+    while(1) {
+        while (p->round == round) pthread_cond_wait(&p->start,&p->lock);
+        round = p->round;
+        if (p->stop) break;
+        pthread_mutex_unlock(&p->lock);
+        p->func(p->arg,id);
+        pthread_mutex_lock(&p->lock);
+        if (--p->pending == 0) pthread_cond_signal(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* Create a pool of 'size' threads, including the caller of poolRun(). */
+struct pool *poolCreate(int size) {
+    struct pool *p = malloc(sizeof(*p));
+    int j;
+
+    p->size = size;
+    p->threads = malloc(sizeof(pthread_t)*size);
+    pthread_mutex_init(&p->lock,NULL);
+    pthread_cond_init(&p->start,NULL);
+    pthread_cond_init(&p->done,NULL);
+    p->round = 0;
+    p->stop = 0;
+    p->pending = 1; /* Used to assign ids, starting from 1. */
+    for (j = 1; j < size; j++) {
+        if (pthread_create(&p->threads[j],NULL,poolThread,p) != 0) {
+            perror("Creating the pool threads");
+            exit(1);
+        }
+    }
+    /* Wait for all the threads to get their id. */
+    pthread_mutex_lock(&p->lock);
+    while (p->pending != size) pthread_cond_wait(&p->done,&p->lock);
+    pthread_mutex_unlock(&p->lock);
+    return p;
+}
+
+/* Run func(arg,id) for every id from 0 to the pool size - 1, in parallel,
+ * and return when all the calls returned. */
+void poolRun(struct pool *p, void (*func)(void *arg, int id), void *arg) {
+    if (p->size > 1) {
+        pthread_mutex_lock(&p->lock);
+        p->func = func;
+        p->arg = arg;
+        p->pending = p->size-1;
+        p->round++;
+        pthread_cond_broadcast(&p->start);
+        pthread_mutex_unlock(&p->lock);
+    }
+    func(arg,0);
+    if (p->size > 1) {
+        pthread_mutex_lock(&p->lock);
+        while (p->pending) pthread_cond_wait(&p->done,&p->lock);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+/* Terminate the pool threads and release the pool. */
+void poolFree(struct pool *p) {
+    int j;
+
+    if (p == NULL) return;
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    p->round++;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+    for (j = 1; j < p->size; j++) pthread_join(p->threads[j],NULL);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->start);
+    pthread_cond_destroy(&p->done);
+    free(p->threads);
+    free(p);
+}
+
+/* Create an evaluator for the specified target image, able to score sets
+ * of up to 'maxshapes' shapes, using 'numcand' candidates per generation.
+ * Every candidate gets its own random stream, seeded from 'rng'.
+ * Call evaluatorReset() before scoring candidates with it. */
+struct evaluator *evaluatorCreate(unsigned char *image, int width, int height, int maxshapes, int numcand, struct rng *rng) {
+    struct evaluator *ev = malloc(sizeof(*ev));
+    int j;
+
+    ev->image = image;
+    ev->width = width;
+    ev->height = height;
+    ev->best = NULL;
+    ev->bestfb = malloc(width*height*3);
+    ev->tilesx = (width+TILE_SIZE-1)/TILE_SIZE;
+    ev->tilesy = (height+TILE_SIZE-1)/TILE_SIZE;
+    ev->tilediff = malloc(sizeof(long long)*ev->tilesx*ev->tilesy);
+    ev->diff = 0;
+    ev->maxinuse = maxshapes;
+    ev->limit = LLONG_MAX;
+    ev->sched = NULL;
+
+    ev->numcand = numcand;
+    ev->cand = malloc(sizeof(struct candidate*)*numcand);
+    for (j = 0; j < numcand; j++) {
+        struct candidate *c = malloc(sizeof(*c));
+
+        rngSeed(&c->rng,((uint64_t)rngNext(rng)<<32)|rngNext(rng),j);
+        c->triangles = mkRandomtriangles(&c->rng,maxshapes,width,height);
+        c->fb = malloc(width*height*3);
+        c->tilediff = malloc(sizeof(long long)*ev->tilesx*ev->tilesy);
+        c->diff = 0;
+        rectReset(&c->dirty);
+        rectReset(&c->stale);
+        c->bands = (opt_band_threads > 1) ? poolCreate(opt_band_threads) : NULL;
+        memset(&c->timing,0,sizeof(c->timing));
+        ev->cand[j] = c;
+    }
+
+    /* Select how often to snapshot: by default we want at most
+     * MAX_SNAPSHOTS full images of memory used for the cache. */
+    ev->snapevery = opt_snapshot_every;
+    if (ev->snapevery == 0) {
+        ev->snapevery = (maxshapes+MAX_SNAPSHOTS-1)/MAX_SNAPSHOTS;
+        if (ev->snapevery < MIN_SNAPSHOT_EVERY)
+            ev->snapevery = MIN_SNAPSHOT_EVERY;
+    } else if (ev->snapevery < 0) {
+        ev->snapevery = 0;
+    }
+    ev->snapcount = (ev->snapevery > 0) ? maxshapes/ev->snapevery : 0;
+    ev->snapvalid = 0;
+    ev->snapinuse = 0;
+    ev->snap = malloc(sizeof(unsigned char*)*(ev->snapcount+1));
+    for (j = 0; j < ev->snapcount; j++)
+        ev->snap[j] = malloc(width*height*3);
+    return ev;
+}
+
+/* Release an evaluator and all its candidates. The target image is not
+ * released, since it is owned by the caller. */
+void evaluatorFree(struct evaluator *ev) {
+    int j;
+
+    for (j = 0; j < ev->numcand; j++) {
+        struct candidate *c = ev->cand[j];
+
+        freeTriangles(c->triangles);
+        free(c->fb);
+        free(c->tilediff);
+        poolFree(c->bands);
+        free(c);
+    }
+    for (j = 0; j < ev->snapcount; j++) free(ev->snap[j]);
+    free(ev->snap);
+    free(ev->cand);
+    free(ev->bestfb);
+    free(ev->tilediff);
+    free(ev);
+}
+
+/* Compute the diff of every tile in the tile aligned rectangle 'r', storing
+ * the per tile result into 'tilediff'. The sum of the tiles is returned.
+ * As soon as the sum exceeds 'budget' the comparison stops, returning the
+ * partial sum: in this case not all the tiles diff are stored. */
+long long diffTiles(struct evaluator *ev, unsigned char *fb, struct rect *r, long long *tilediff, long long budget) {
+    int tx, ty, y;
+    long long sum = 0;
+
+    for (ty = r->y0/TILE_SIZE; ty <= r->y1/TILE_SIZE; ty++) {
+        int y0 = ty*TILE_SIZE;
+        int y1 = y0+TILE_SIZE-1;
+
+        if (y1 >= ev->height) y1 = ev->height-1;
+        for (tx = r->x0/TILE_SIZE; tx <= r->x1/TILE_SIZE; tx++) {
+            int x0 = tx*TILE_SIZE;
+            int w = TILE_SIZE;
+            long long d = 0;
+
+            if (x0+w > ev->width) w = ev->width-x0;
+            for (y = y0; y <= y1; y++) {
+                int off = (y*ev->width+x0)*3;
+                d += computeDiff(ev->image+off,fb+off,w,1);
+            }
+            tilediff[ty*ev->tilesx+tx] = d;
+            sum += d;
+            if (sum > budget) return sum;
+        }
+    }
+    return sum;
+}
+
+/* Copy the rectangle 'r' of the framebuffer 'src' into 'dst'. */
+void copyRect(struct evaluator *ev, unsigned char *dst, unsigned char *src, struct rect *r) {
+    int y, len = (r->x1-r->x0+1)*3;
+
+    for (y = r->y0; y <= r->y1; y++) {
+        int off = (y*ev->width+r->x0)*3;
+        memcpy(dst+off,src+off,len);
+    }
+}
+
+/* Clear the rectangle 'r' of the framebuffer 'fb' to black. */
+void clearRect(struct evaluator *ev, unsigned char *fb, struct rect *r) {
+    int y, len = (r->x1-r->x0+1)*3;
+
+    for (y = r->y0; y <= r->y1; y++)
+        memset(fb+(y*ev->width+r->x0)*3,0,len);
+}
+
+/* Render and optionally compare the band 'id' of a band job. Bands are
+ * made of whole rows of tiles, so that every tile belongs to a single band
+ * and can be compared by the thread that rendered it. */
+void renderBand(void *arg, int id) {
+    struct bandJob *job = arg;
+    struct rect r = job->area;
+    int rows = r.y1/TILE_SIZE - r.y0/TILE_SIZE + 1;
+    int first = r.y0/TILE_SIZE + rows*id/job->bands;
+    int last = r.y0/TILE_SIZE + rows*(id+1)/job->bands - 1;
+    long long start = 0, drawn = 0;
+
+    job->diff[id] = 0;
+    job->drawtime[id] = job->difftime[id] = job->pixels[id] = 0;
+    if (first > last) return;
+    if (first*TILE_SIZE > r.y0) r.y0 = first*TILE_SIZE;
+    if ((last+1)*TILE_SIZE-1 < r.y1) r.y1 = (last+1)*TILE_SIZE-1;
+    if (job->timed) start = ustime();
+    if (job->base)
+        copyRect(job->ev,job->fb,job->base,&r);
+    else
+        clearRect(job->ev,job->fb,&r);
+    job->pixels[id] =
+        drawtrianglesRange(job->fb,job->ev->width,&r,job->t,job->start,job->end);
+    if (job->timed) {
+        drawn = ustime();
+        job->drawtime[id] = drawn-start;
+    }
+    if (job->tilediff) {
+        job->diff[id] = diffTiles(job->ev,job->fb,&r,job->tilediff,
+            job->budget);
+        if (job->timed) job->difftime[id] = ustime()-drawn;
+    }
+}
+
+/* Render in the area 'r' of 'fb' the shapes of 't' from 'start' to 'end'
+ * (excluded), drawing over the content of the framebuffer 'base', or over
+ * a black image if 'base' is NULL. If 'tilediff' is not NULL the area must
+ * be tile aligned, and the diff of every tile is computed and stored into
+ * 'tilediff': in this case the sum of the tiles diff is returned. If the
+ * sum exceeds 'budget' the comparison may stop early, and the returned
+ * value is only guaranteed to be greater than 'budget'.
+ *
+ * If 'bands' is not NULL and the area is large enough, the work is split
+ * into horizontal bands processed in parallel by the pool threads.
+ *
+ * If 'tm' is not NULL the time spent drawing and comparing is added to it. */
+long long renderArea(struct evaluator *ev, struct pool *bands, unsigned char *fb, unsigned char *base, struct rect *r, struct triangles *t, int start, int end, long long *tilediff, long long budget, struct timing *tm) {
+    struct bandJob job;
+    long long diff = 0;
+    int j;
+
+    if (rectIsEmpty(r)) return 0;
+    job.ev = ev;
+    job.fb = fb;
+    job.base = base;
+    job.area = *r;
+    job.t = t;
+    job.start = start;
+    job.end = end;
+    job.tilediff = tilediff;
+    job.budget = budget;
+    job.timed = tm != NULL;
+    job.bands = 1;
+    if (bands && (long long)(r->x1-r->x0+1)*(r->y1-r->y0+1) >= BAND_MIN_PIXELS)
+        job.bands = bands->size;
+
+    if (job.bands > 1)
+        poolRun(bands,renderBand,&job);
+    else
+        renderBand(&job,0);
+    for (j = 0; j < job.bands; j++) {
+        diff += job.diff[j];
+        if (tm) {
+            tm->draw += job.drawtime[j];
+            tm->diff += job.difftime[j];
+            tm->pixels += job.pixels[j];
+        }
+    }
+    return diff;
+}
+
+/* Bring the snapshots in sync with the new best solution 'best', that is
+ * only different from the previous one inside the rectangle 'r' and for the
+ * shapes starting at index 'minidx'. Snapshots that were not valid for the
+ * previous solution are rendered in full.
+ *
+ * When a shape was removed, all the shapes after it moved one position
+ * down, so the last shape of every snapshot after 'minidx' is a shape that
+ * was not part of it before: its area must be redrawn as well, in this
+ * snapshot and in all the ones above it. */
+void updateSnapshots(struct evaluator *ev, struct pool *bands, struct triangles *best, int minidx, struct rect *r, struct timing *tm) {
+    struct rect all = {0, 0, ev->width-1, ev->height-1};
+    struct rect changed = *r;
+    int valid, j, removed = best->inuse < ev->snapinuse;
+
+    ev->snapinuse = best->inuse;
+    if (ev->snapevery == 0) return;
+    valid = best->inuse / ev->snapevery;
+    if (valid > ev->snapcount) valid = ev->snapcount;
+    for (j = minidx/ev->snapevery; j < valid; j++) {
+        struct rect *area = (j < ev->snapvalid) ? &changed : &all;
+
+        if (removed) {
+            struct rect box;
+
+            shapeRect(&best->triangles[(j+1)*ev->snapevery-1],&box);
+            rectUnion(&changed,&box);
+            rectClip(&changed,ev->width,ev->height);
+        }
+
+        renderArea(ev,bands,ev->snap[j],j ? ev->snap[j-1] : NULL,area,
+            best,j*ev->snapevery,(j+1)*ev->snapevery,NULL,LLONG_MAX,tm);
+    }
+    ev->snapvalid = valid;
+}
+
+/* Render from scratch the specified set of triangles as the current best
+ * solution, computing the diff of every tile. This must be called every
+ * time the best solution changes without passing from acceptCandidate(). */
+void evaluatorReset(struct evaluator *ev, struct triangles *best) {
+    struct rect all = {0, 0, ev->width-1, ev->height-1};
+    int j;
+
+    ev->best = best;
+    ev->snapvalid = 0;
+    ev->snapinuse = best->inuse;
+    updateSnapshots(ev,ev->cand[0]->bands,best,0,&all,NULL);
+    ev->diff = renderArea(ev,ev->cand[0]->bands,ev->bestfb,NULL,&all,
+        best,0,best->inuse,ev->tilediff,LLONG_MAX,NULL);
+    for (j = 0; j < ev->numcand; j++) {
+        struct candidate *c = ev->cand[j];
+
+        c->triangles->inuse = best->inuse;
+        memcpy(c->triangles->triangles,best->triangles,
+            sizeof(struct triangle)*best->inuse);
+        c->m.undolen = 0;
+        rectReset(&c->dirty);
+        c->stale = all;
+    }
+}
+
+/* Score the candidate 'c', that differs from the current best solution as
+ * described by its mutation. Only the tiles covering the dirty area are
+ * redrawn and compared with the target image, the difference of all the
+ * other tiles is taken from the cache. The diff is returned and also
+ * stored in the candidate.
+ *
+ * The comparison stops as soon as the diff is known to exceed 'ev->limit':
+ * in this case the diff is LLONG_MAX, and the candidate must be rejected.
+ *
+ * The candidate must be either accepted or rejected calling acceptCandidate()
+ * or rejectCandidate() before evaluating it again. Different candidates can
+ * be evaluated at the same time by different threads. */
+long long evaluateCandidate(struct evaluator *ev, struct candidate *c) {
+    struct rect *r = &c->dirty;
+    long long olddiff = 0, newdiff, budget;
+    int tx, ty, base = 0;
+
+    /* Restore what changed since the last time we used the framebuffer. */
+    if (!rectIsEmpty(&c->stale)) {
+        copyRect(ev,c->fb,ev->bestfb,&c->stale);
+        rectReset(&c->stale);
+    }
+
+    *r = c->m.dirty;
+    rectClip(r,ev->width,ev->height);
+    if (rectIsEmpty(r)) return (c->diff = ev->diff);
+
+    /* Align the area to the tiles grid. */
+    r->x0 -= r->x0 % TILE_SIZE;
+    r->y0 -= r->y0 % TILE_SIZE;
+    r->x1 += TILE_SIZE-1 - (r->x1 % TILE_SIZE);
+    r->y1 += TILE_SIZE-1 - (r->y1 % TILE_SIZE);
+    rectClip(r,ev->width,ev->height);
+
+    /* Start from the nearest snapshot below the first modified shape. */
+    if (ev->snapevery) {
+        base = c->m.minidx/ev->snapevery;
+        if (base > ev->snapvalid) base = ev->snapvalid;
+    }
+    /* The diff of the area can't exceed the limit minus the diff of all
+     * the tiles outside it. */
+    for (ty = r->y0/TILE_SIZE; ty <= r->y1/TILE_SIZE; ty++)
+        for (tx = r->x0/TILE_SIZE; tx <= r->x1/TILE_SIZE; tx++)
+            olddiff += ev->tilediff[ty*ev->tilesx+tx];
+    budget = (ev->limit == LLONG_MAX) ? LLONG_MAX :
+                                        ev->limit - (ev->diff - olddiff);
+    newdiff = renderArea(ev,c->bands,c->fb,base ? ev->snap[base-1] : NULL,
+        r,c->triangles,base*ev->snapevery,c->triangles->inuse,c->tilediff,
+        budget,&c->timing);
+    if (newdiff > budget) return (c->diff = LLONG_MAX);
+    return (c->diff = ev->diff - olddiff + newdiff);
+}
+
+/* The evaluated candidate 'c' becomes the new best solution. The other
+ * candidates revert their own mutation and apply the accepted one, and the
+ * area it changed becomes stale in their framebuffers. */
+void acceptCandidate(struct evaluator *ev, struct candidate *c) {
+    struct rect *r = &c->dirty;
+    int tx, ty, j;
+
+    mutationCopy(&c->m,ev->best,c->triangles);
+    for (j = 0; j < ev->numcand; j++) {
+        struct candidate *o = ev->cand[j];
+
+        if (o == c) continue;
+        mutationUndo(&o->m,o->triangles);
+        mutationCopy(&c->m,o->triangles,c->triangles);
+    }
+    c->m.undolen = 0;
+    updateSnapshots(ev,c->bands,ev->best,c->m.minidx,r,&c->timing);
+    if (rectIsEmpty(r)) return;
+    copyRect(ev,ev->bestfb,c->fb,r);
+    for (ty = r->y0/TILE_SIZE; ty <= r->y1/TILE_SIZE; ty++) {
+        for (tx = r->x0/TILE_SIZE; tx <= r->x1/TILE_SIZE; tx++) {
+            int idx = ty*ev->tilesx+tx;
+            ev->diff += c->tilediff[idx] - ev->tilediff[idx];
+            ev->tilediff[idx] = c->tilediff[idx];
+        }
+    }
+    for (j = 0; j < ev->numcand; j++)
+        if (ev->cand[j] != c) rectUnion(&ev->cand[j]->stale,r);
+    rectReset(r);
+}
+
+/* The evaluated candidate 'c' is discarded: its mutation is reverted, and
+ * the area it changed will be restored from the best solution before its
+ * next evaluation. Calling it on an already accepted or rejected candidate
+ * does nothing. */
+void rejectCandidate(struct evaluator *ev, struct candidate *c) {
+    (void)ev;
+    mutationUndo(&c->m,c->triangles);
+    rectUnion(&c->stale,&c->dirty);
+    rectReset(&c->dirty);
+}
+
+/* Add a random shape at the end of the set. */
+void mutationAdd(struct rng *rng, struct triangles *rs, int width, int height, struct mutation *m) {
+    int r = rngBelow(rng,5);
+
+    mutationLog(m,rs,UNDO_SET,rs->inuse);
+    if (r == 0) {
+        randomtriangle(rng,&rs->triangles[rs->inuse],width,height);
+    } else if (r == 1) {
+        randomsmalltriangle(rng,&rs->triangles[rs->inuse],width,height,5);
+    } else if (r == 2) {
+        randomsmalltriangle(rng,&rs->triangles[rs->inuse],width,height,10);
+    } else if (r == 3) {
+        randomsmalltriangle(rng,&rs->triangles[rs->inuse],width,height,25);
+    } else if (r == 4) {
+        randomsmalltriangle(rng,&rs->triangles[rs->inuse],width,height,2);
+    }
+    markDirty(m,rs,rs->inuse);
+    m->kinds |= 1<<MUT_ADD;
+    rs->inuse++;
+}
+
+/* Remove a random shape from the set. */
+void mutationRemove(struct rng *rng, struct triangles *rs, struct mutation *m) {
+    int delidx = rngBelow(rng,rs->inuse);
+
+    markDirty(m,rs,delidx);
+    mutationLog(m,rs,UNDO_DELETE,delidx);
+    m->maxidx = rs->inuse-1; /* All the shapes after it moved. */
+    m->kinds |= 1<<MUT_REMOVE;
+    rs->inuse--;
+    memmove(rs->triangles+delidx,rs->triangles+delidx+1,sizeof(struct triangle)*(rs->inuse-delidx));
+}
+
+/* Swap two random shapes, that may be the same shape. */
+void mutationSwap(struct rng *rng, struct triangles *rs, struct mutation *m) {
+    int a, b;
+    a = rngBelow(rng,rs->inuse);
+    b = rngBelow(rng,rs->inuse);
+    if (a != b) {
+        struct triangle aux;
+
+        markDirty(m,rs,a);
+        markDirty(m,rs,b);
+        mutationLog(m,rs,UNDO_SET,a);
+        mutationLog(m,rs,UNDO_SET,b);
+        aux = rs->triangles[a];
+        rs->triangles[a] = rs->triangles[b];
+        rs->triangles[b] = aux;
+        m->kinds |= 1<<MUT_SWAP;
+    }
+}
+
+/* Apply the mutatetriangle() choice 'choice' to the shape at index 'idx'. */
+void mutationShape(struct rng *rng, struct triangles *rs, int idx, int choice, int width, int height, struct mutation *m) {
+    markDirty(m,rs,idx);
+    mutationLog(m,rs,UNDO_SET,idx);
+    mutateShape(rng,&rs->triangles[idx],width,height,choice);
+    m->kinds |= 1<<(MUT_VERTEXES+choice);
+    markDirty(m,rs,idx);
+}
+
+/* Adaptive selection of the mutation kind, that is a multi armed bandit:
+ * for every kind the scheduler keeps a moving average of the improvement
+ * of the diff per microsecond spent evaluating candidates of that kind,
+ * and picks the kinds with probabilities proportional to it. No kind is
+ * picked with a probability less than SCHED_MIN_PROB, so that kinds that
+ * were useless for a while are still tried, and can recover. */
+#define SCHED_MIN_PROB 0.02
+#define SCHED_DECAY 0.002       /* Weight of a new sample in the average. */
+
+struct scheduler {
+    double payoff[MUT_KINDS];   /* Average improvement per microsecond. */
+    double cumprob[MUT_KINDS];  /* Cumulative probabilities of the kinds. */
+};
+
+/* Compute the probabilities of the kinds from their payoff. */
+void schedulerUpdateProbs(struct scheduler *s) {
+    double sum = 0, acc = 0;
+    int k;
+
+    for (k = 0; k < MUT_KINDS; k++) sum += s->payoff[k];
+    for (k = 0; k < MUT_KINDS; k++) {
+        double p = (sum > 0) ? s->payoff[k]/sum : 1.0/MUT_KINDS;
+
+        acc += SCHED_MIN_PROB + (1-SCHED_MIN_PROB*MUT_KINDS)*p;
+        s->cumprob[k] = acc;
+    }
+    s->cumprob[MUT_KINDS-1] = 1;
+}
+
+struct scheduler *schedulerCreate(void) {
+    struct scheduler *s = malloc(sizeof(*s));
+
+    memset(s->payoff,0,sizeof(s->payoff));
+    schedulerUpdateProbs(s);
+    return s;
+}
+
+/* Account a candidate of kind 'kind' that improved the diff by
+ * 'improvement' (zero if it did not improve), evaluated in 'us'
+ * microseconds. Call schedulerUpdateProbs() after the updates. */
+void schedulerUpdate(struct scheduler *s, int kind, long long improvement, long long us) {
+    double sample = (double)improvement/(us > 0 ? us : 1);
+
+    s->payoff[kind] += (sample-s->payoff[kind])*SCHED_DECAY;
+}
+
+/* Pick a random mutation kind according to the current probabilities. */
+int schedulerPick(struct scheduler *s, struct rng *rng) {
+    float r = rngFloat(rng);
+    int k;
+
+    for (k = 0; k < MUT_KINDS-1; k++)
+        if (r < s->cumprob[k]) break;
+    return k;
+}
+
+/* Apply a mutation to a set of triangles, using at most 'maxinuse' shapes.
+ * The modified shapes and the area of the image affected by the mutation
+ * are recorded into 'm', together with the log to revert it.
+ *
+ * If 'sched' is NULL the fixed scheme is used: maybe add or remove a shape,
+ * maybe swap two shapes, then mutate up to 'count' random shapes according
+ * to 'opt_mutation_rate'. Otherwise a single mutation of the kind picked
+ * by the scheduler is applied. */
+void mutatetriangles(struct rng *rng, struct triangles *rs, int count, int maxinuse, int width, int height, struct mutation *m, struct scheduler *sched) {
+    int j, canadd = rs->inuse != rs->count && rs->inuse < maxinuse;
+
+    if (sched) {
+        int kind = schedulerPick(sched,rng);
+
+        /* Kinds not possible in this state become a small move. */
+        if ((kind == MUT_ADD && !canadd) ||
+            ((kind == MUT_REMOVE || kind == MUT_SWAP) && rs->inuse < 2))
+            kind = MUT_MOVE_SMALL;
+        if (kind == MUT_ADD) {
+            mutationAdd(rng,rs,width,height,m);
+        } else if (kind == MUT_REMOVE) {
+            mutationRemove(rng,rs,m);
+        } else if (kind == MUT_SWAP) {
+            do mutationSwap(rng,rs,m); while (m->kinds == 0);
+        } else {
+            mutationShape(rng,rs,rngBelow(rng,rs->inuse),kind-MUT_VERTEXES,
+                width,height,m);
+        }
+        return;
+    }
+
+    /* Add a new triangle? */
+    if (rngBelow(rng,10) == 0 && canadd) {
+        mutationAdd(rng,rs,width,height,m);
+        return;
+    }
+
+    /* Remove a triangle? */
+    if (rngBelow(rng,20) == 0 && rs->inuse > 1) {
+        mutationRemove(rng,rs,m);
+        return;
+    }
+
+    /* Swap two triangles */
+    if (rngBelow(rng,20) == 0) mutationSwap(rng,rs,m);
+
+    /* Mutate every single triangle. */
+    for (j = 0; j < count; j++) {
+        int idx = rngBelow(rng,rs->inuse);
+        if ((int)rngBelow(rng,1000) < opt_mutation_rate)
+            mutationShape(rng,rs,idx,rngBelow(rng,6),width,height,m);
+    }
+}
+
+/* Pool job: derive the candidate 'id' from the best solution applying a
+ * random mutation, and score it. The candidate set of shapes is always
+ * equal to the best solution when the job starts, so the mutation is
+ * applied in place. */
+void generateCandidate(void *arg, int id) {
+    struct evaluator *ev = arg;
+    struct candidate *c = ev->cand[id];
+    long long start = ustime();
+
+    mutationReset(&c->m,c->triangles);
+    mutatetriangles(&c->rng,c->triangles,10,ev->maxinuse,ev->width,ev->height,
+        &c->m,ev->sched);
+    c->timing.mutate += ustime()-start;
+    evaluateCandidate(ev,c);
+    c->evaltime = ustime()-start;
+}
+
+/* Return the candidate with the lowest diff. */
+struct candidate *bestCandidate(struct evaluator *ev) {
+    struct candidate *best = ev->cand[0];
+    int j;
+
+    for (j = 1; j < ev->numcand; j++)
+        if (ev->cand[j]->diff < best->diff) best = ev->cand[j];
+    return best;
+}
+
+/* Open a temporary file to write 'filename' atomically: the file is
+ * written as 'filename.tmp', then renamed by commitTemp(), so that a
+ * process killed in the middle of a save never leaves a torn file.
+ * The temporary file name is stored into 'tmpname', PATH_MAX bytes. */
+FILE *openTemp(char *filename, char *tmpname, char *mode) {
+    FILE *fp;
+
+    snprintf(tmpname,PATH_MAX,"%s.tmp",filename);
+    if ((fp = fopen(tmpname,mode)) == NULL) perror(tmpname);
+    return fp;
+}
+
+/* Flush the temporary file to disk and rename it to 'filename'.
+ * Return 0 on success, -1 on error. */
+int commitTemp(FILE *fp, char *tmpname, char *filename) {
+    int err = ferror(fp);
+
+    if (fflush(fp) == EOF || fsync(fileno(fp)) == -1) err = 1;
+    if (fclose(fp) == EOF) err = 1;
+    if (err) {
+        fprintf(stderr,"Error writing %s\n", tmpname);
+        unlink(tmpname);
+        return -1;
+    }
+    if (rename(tmpname,filename) == -1) {
+        perror(filename);
+        unlink(tmpname);
+        return -1;
+    }
+    return 0;
+}
+
+/* Write the SVG header and the black background of the image. */
+void svgHeader(FILE *fp, int width, int height) {
+    fprintf(fp,"<?xml version=\"1.0\" standalone=\"no\"?><!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.1//EN\" \"http://www.w3.org/Graphics/SVG/1.1/DTD/svg11.dtd\"><svg width=\"100%%\" height=\"100%%\" style=\"background-color:#000000;\" version=\"1.1\" xmlns=\"http://www.w3.org/2000/svg\">\n");
+    fprintf(fp,"<polygon points=\"0,0 %d,0 %d,%d 0,%d\" style=\"fill:#000000;stroke:#000000;stroke-width:0;fill-opacity:1;\"/>\n",width-1,width-1,height-1,height-1);
+}
+
+/* Write the shapes of a set of triangles as SVG elements. */
+void svgShapes(FILE *fp, struct triangles *triangles) {
+    int j;
+
+    for(j=0;j<triangles->inuse;j++) {
+        struct triangle *t = &triangles->triangles[j];
+        if (t->type == TYPE_TRIANGLE) {
+            fprintf(fp,"<polygon points=\"%d,%d %d,%d %d,%d\" style=\"fill:#%02x%02x%02x;stroke:#000000;stroke-width:0;fill-opacity:%.2f;\"/>\n",t->u.t.x1,t->u.t.y1,t->u.t.x2,t->u.t.y2,t->u.t.x3,t->u.t.y3,t->r,t->g,t->b,(float)t->alpha/100);
+        } else if (t->type == TYPE_CIRCLE) {
+            fprintf(fp,"<circle cx=\"%d\" cy=\"%d\" r=\"%d\" style=\"fill:#%02x%02x%02x;stroke:#000000;stroke-width:0;fill-opacity:%.2f;\"/>\n",t->u.c.x1,t->u.c.y1,t->u.c.radius,t->r,t->g,t->b,(float)t->alpha/100);
+        }
+    }
+}
+
+/* Save a set of triangles as SVG. Return 0 on success, -1 on error. */
+int saveSvg(char *filename,struct triangles *triangles, int width, int height) {
+    char tmpname[PATH_MAX];
+    FILE *fp = openTemp(filename,tmpname,"w");
+
+    if (!fp) return -1;
+    svgHeader(fp,width,height);
+    svgShapes(fp,triangles);
+    fprintf(fp,"</svg>\n");
+    return commitTemp(fp,tmpname,filename);
+}
+
+/* Binary state file format. All the fields are little endian, so that
+ * files can be moved between machines, and the file can be validated
+ * directly in memory after mapping it.
+ *
+ * Header, BIN_HEADER_SIZE bytes:
+ *
+ *   0  "SHAPEME\0"
+ *   8  u32 format version, BIN_VERSION
+ *  12  u32 header size
+ *  16  u32 record size
+ *  20  u32 max shapes
+ *  24  u32 max shapes incremental
+ *  28  u32 number of records
+ *  32  f32 temperature
+ *  36  f32 absolute best diff
+ *  40  u64 generation
+ *  48  u32 CRC32 of the whole file, computed with this field set to zero
+ *  52  reserved, zero
+ *
+ * Followed by one record of BIN_RECORD_SIZE bytes for every shape in use:
+ *
+ *   0  u8 type, u8 r, u8 g, u8 b, u8 alpha, u8 zero
+ *   6  6 x i16: x1,y1,x2,y2,x3,y3 for triangles, x1,y1,radius for circles
+ *  18  2 bytes zero
+ *
+ * Readers skip the extra bytes of headers and records larger than the
+ * ones they know, so fields can be appended without a new version. */
+#define BIN_MAGIC "SHAPEME"
+#define BIN_VERSION 1
+#define BIN_HEADER_SIZE 64
+#define BIN_RECORD_SIZE 20
+#define BIN_CRC_OFFSET 48
+#define BIN_MAX_SHAPES (1<<24)
+
+void putU16(unsigned char *p, uint16_t v) {
+    p[0] = v; p[1] = v >> 8;
+}
+
+void putU32(unsigned char *p, uint32_t v) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+void putU64(unsigned char *p, uint64_t v) {
+    putU32(p,v);
+    putU32(p+4,v >> 32);
+}
+
+uint16_t getU16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+uint32_t getU32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint64_t getU64(const unsigned char *p) {
+    return getU32(p) | ((uint64_t)getU32(p+4) << 32);
+}
+
+/* Encode the shape 't' as a record of BIN_RECORD_SIZE bytes at 'p'. */
+void putShape(unsigned char *p, struct triangle *t) {
+    memset(p,0,BIN_RECORD_SIZE);
+    p[0] = t->type; p[1] = t->r; p[2] = t->g; p[3] = t->b;
+    p[4] = t->alpha;
+    if (t->type == TYPE_TRIANGLE) {
+        putU16(p+6,t->u.t.x1); putU16(p+8,t->u.t.y1);
+        putU16(p+10,t->u.t.x2); putU16(p+12,t->u.t.y2);
+        putU16(p+14,t->u.t.x3); putU16(p+16,t->u.t.y3);
+    } else {
+        putU16(p+6,t->u.c.x1); putU16(p+8,t->u.c.y1);
+        putU16(p+10,t->u.c.radius);
+    }
+}
+
+/* Decode the shape record at 'p' into 't'. */
+void getShape(const unsigned char *p, struct triangle *t) {
+    t->type = (p[0] == TYPE_CIRCLE) ? TYPE_CIRCLE : TYPE_TRIANGLE;
+    t->r = p[1]; t->g = p[2]; t->b = p[3]; t->alpha = p[4];
+    if (t->type == TYPE_TRIANGLE) {
+        t->u.t.x1 = getU16(p+6); t->u.t.y1 = getU16(p+8);
+        t->u.t.x2 = getU16(p+10); t->u.t.y2 = getU16(p+12);
+        t->u.t.x3 = getU16(p+14); t->u.t.y3 = getU16(p+16);
+    } else {
+        t->u.c.x1 = getU16(p+6); t->u.c.y1 = getU16(p+8);
+        t->u.c.radius = getU16(p+10);
+    }
+    shapeSetup(t);
+}
+
+/* Update the CRC32 (IEEE 802.3 polynomial) 'crc' with 'len' bytes.
+ * Start with a crc of 0. */
+uint32_t crc32Update(uint32_t crc, const unsigned char *p, size_t len) {
+    static uint32_t table[256];
+    static int init = 0;
+    uint32_t j, k;
+
+    if (!init) {
+        for (j = 0; j < 256; j++) {
+            uint32_t c = j;
+            for (k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[j] = c;
+        }
+        init = 1;
+    }
+    crc = ~crc;
+    while (len--) crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/* Checksum of a binary file of 'len' bytes, skipping the CRC field. */
+uint32_t binaryChecksum(const unsigned char *buf, size_t len) {
+    static const unsigned char zero[4] = {0,0,0,0};
+    uint32_t crc;
+
+    crc = crc32Update(0,buf,BIN_CRC_OFFSET);
+    crc = crc32Update(crc,zero,4);
+    return crc32Update(crc,buf+BIN_CRC_OFFSET+4,len-BIN_CRC_OFFSET-4);
+}
+
+/* Save a binary representation of a set of triangles and the program state.
+ * Return 0 on success, -1 on error. */
+int saveBinary(char *filename,struct triangles *triangles,struct globalState *st) {
+    char tmpname[PATH_MAX];
+    size_t len = BIN_HEADER_SIZE + (size_t)BIN_RECORD_SIZE*triangles->inuse;
+    unsigned char *buf = calloc(len,1);
+    uint32_t fbits;
+    FILE *fp;
+    int j;
+
+    memcpy(buf,BIN_MAGIC,sizeof(BIN_MAGIC));
+    putU32(buf+8,BIN_VERSION);
+    putU32(buf+12,BIN_HEADER_SIZE);
+    putU32(buf+16,BIN_RECORD_SIZE);
+    putU32(buf+20,st->max_shapes);
+    putU32(buf+24,st->max_shapes_incremental);
+    putU32(buf+28,triangles->inuse);
+    memcpy(&fbits,&st->temperature,4); putU32(buf+32,fbits);
+    memcpy(&fbits,&st->absbestdiff,4); putU32(buf+36,fbits);
+    putU64(buf+40,st->generation);
+    for (j = 0; j < triangles->inuse; j++)
+        putShape(buf+BIN_HEADER_SIZE+j*BIN_RECORD_SIZE,&triangles->triangles[j]);
+    putU32(buf+BIN_CRC_OFFSET,binaryChecksum(buf,len));
+
+    if ((fp = openTemp(filename,tmpname,"wb")) == NULL) {
+        free(buf);
+        return -1;
+    }
+    fwrite(buf,len,1,fp);
+    free(buf);
+    return commitTemp(fp,tmpname,filename);
+}
+
+/* Load a file in the format used before the versioned one: the raw
+ * globalState, triangles and triangle structures, in the layout of the
+ * machine that saved them. Return 0 on success, -1 if the file is not in
+ * this format. */
+int loadLegacyBinary(const unsigned char *buf, size_t len, struct triangles *triangles) {
+    struct globalState st;
+    struct triangles hdr;
+    struct legacyTriangle {     /* struct triangle without drawing data. */
+        int type;
+        unsigned char r,g,b,alpha;
+        union {
+            struct {
+                short x1,y1,x2,y2,x3,y3;
+            } t;
+            struct {
+                short x1,y1,radius;
+            } c;
+        } u;
+    } lt;
+    size_t base = sizeof(st)+sizeof(hdr);
+    int j;
+
+    if (len < base) return -1;
+    memcpy(&st,buf,sizeof(st));
+    memcpy(&hdr,buf+sizeof(st),sizeof(hdr));
+    if (st.max_shapes <= 0 || st.max_shapes > BIN_MAX_SHAPES ||
+        hdr.inuse < 0 || hdr.inuse > st.max_shapes ||
+        len != base+sizeof(lt)*hdr.inuse) return -1;
+
+    state = st;
+    free(triangles->triangles);
+    triangles->triangles = malloc(sizeof(struct triangle)*state.max_shapes);
+    triangles->count = state.max_shapes;
+    triangles->inuse = hdr.inuse;
+    for (j = 0; j < hdr.inuse; j++) {
+        struct triangle *t = &triangles->triangles[j];
+
+        memcpy(&lt,buf+base+sizeof(lt)*j,sizeof(lt));
+        t->type = lt.type;
+        t->r = lt.r; t->g = lt.g; t->b = lt.b; t->alpha = lt.alpha;
+        memcpy(&t->u,&lt.u,sizeof(t->u));
+        shapeSetup(t);
+    }
+    return 0;
+}
+
+/* Load a binary representation of a set of triangles and the program state,
+ * into 'triangles' and the global state. Files in the old, not portable,
+ * format are converted to the current one.
+ * Returns 1 if the state was loaded, 0 if there is no such file. */
+int loadBinary(char *filename,struct triangles *triangles) {
+    int fd = open(filename,O_RDONLY);
+    struct stat sb;
+    const unsigned char *buf;
+    uint32_t count, hdrlen, reclen, fbits;
+    int j, upgraded = 0;
+    size_t len;
+
+    if (fd == -1) return 0; /* If there is no file we start with a clear state. */
+    if (fstat(fd,&sb) == -1 || sb.st_size == 0) goto loaderr;
+    len = sb.st_size;
+    buf = mmap(NULL,len,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (buf == MAP_FAILED) goto loaderr;
+
+    if (len < BIN_HEADER_SIZE || memcmp(buf,BIN_MAGIC,sizeof(BIN_MAGIC))) {
+        if (loadLegacyBinary(buf,len,triangles) == -1) goto loaderr;
+        upgraded = 1;
+    } else {
+        /* Validate everything before touching the current state. */
+        hdrlen = getU32(buf+12);
+        reclen = getU32(buf+16);
+        count = getU32(buf+28);
+        if (getU32(buf+8) > BIN_VERSION) {
+            fprintf(stderr,"Binary file version %u not supported\n",
+                getU32(buf+8));
+            exit(1);
+        }
+        if (getU32(buf+8) == 0 ||
+            hdrlen < BIN_HEADER_SIZE || reclen < BIN_RECORD_SIZE ||
+            getU32(buf+20) == 0 || getU32(buf+20) > BIN_MAX_SHAPES ||
+            count > getU32(buf+20) || hdrlen > len ||
+            (len-hdrlen)/reclen != count || (len-hdrlen)%reclen ||
+            getU32(buf+BIN_CRC_OFFSET) != binaryChecksum(buf,len))
+            goto loaderr;
+
+        state.max_shapes = getU32(buf+20);
+        state.max_shapes_incremental = getU32(buf+24);
+        fbits = getU32(buf+32); memcpy(&state.temperature,&fbits,4);
+        fbits = getU32(buf+36); memcpy(&state.absbestdiff,&fbits,4);
+        state.generation = getU64(buf+40);
+        free(triangles->triangles);
+        triangles->triangles = malloc(sizeof(struct triangle)*state.max_shapes);
+        triangles->count = state.max_shapes;
+        triangles->inuse = count;
+        for (j = 0; j < (int)count; j++)
+            getShape(buf+hdrlen+(size_t)j*reclen,&triangles->triangles[j]);
+    }
+    munmap((void*)buf,len);
+    printf("Loaded %d triangles\n", triangles->inuse);
+
+    /* Let the program continue with the current number of triangles. */
+    state.max_shapes_incremental = triangles->inuse;
+    if (upgraded) {
+        printf("Upgrading %s to the binary format version %d\n",
+            filename, BIN_VERSION);
+        if (saveBinary(filename,triangles,&state) == -1) exit(1);
+    }
+    return 1;
+
+loaderr:
+    fprintf(stderr, "Error loading the binary file %s\n", filename);
+    exit(1);
+}
+
+/* The journal is an append-only file recording every improvement of the
+ * absolute best solution as the list of the shapes that changed since the
+ * previous record, so that saving an improvement costs a few bytes instead
+ * of rewriting the whole solution, and the whole history of the evolution
+ * can be reconstructed later. Layout, all the integers are little endian:
+ *
+ *   0  "SHAPEJN\0" magic
+ *   8  u32 format version
+ *  12  u32 size of the shape records (BIN_RECORD_SIZE)
+ *
+ * Followed by the records:
+ *
+ *   0  u8 type: JNL_SNAPSHOT or JNL_DELTA, 3 bytes zero
+ *   4  u32 number of shapes that follow
+ *   8  u64 generation
+ *  16  f32 absolute best diff
+ *  20  f32 temperature
+ *  24  u32 max shapes
+ *  28  u32 max shapes incremental
+ *  32  u32 shapes in use
+ *  36  for every shape: u32 index, and the shape record
+ *   .  u32 CRC32 of all the above
+ *
+ * Snapshots contain all the shapes in use and are written every
+ * JNL_SNAPSHOT_EVERY deltas, so that a torn or corrupted file loses the
+ * least history. When the file grows beyond 'opt_journal_max_size' it is
+ * compacted, rewriting it with just the latest snapshot. */
+#define JNL_MAGIC "SHAPEJN"
+#define JNL_VERSION 1
+#define JNL_HEADER_SIZE 16
+#define JNL_RECORD_HEADER 36
+#define JNL_ENTRY_SIZE (4+BIN_RECORD_SIZE)
+#define JNL_SNAPSHOT 1
+#define JNL_DELTA 2
+#define JNL_SNAPSHOT_EVERY 1000
+
+struct journal {
+    char *filename;
+    FILE *fp;
+    long long size;             /* Current size of the file. */
+    int deltas;                 /* Deltas since the last snapshot. */
+    int count;                  /* Max number of shapes. */
+    int inuse;                  /* Shapes in use at the last record. */
+    unsigned char *last;        /* Shape records at the last record. */
+    unsigned char *buf;         /* Record being written. */
+};
+
+/* Open the journal 'filename' to append to it, creating it if needed. If
+ * 'truncate' is true the old history is discarded. The first record
+ * appended is always a snapshot. Return NULL on error. */
+struct journal *journalOpen(char *filename, int count, int truncate) {
+    struct journal *j = malloc(sizeof(*j));
+    unsigned char hdr[JNL_HEADER_SIZE];
+
+    if ((j->fp = fopen(filename,truncate ? "wb" : "ab")) == NULL) {
+        perror(filename);
+        free(j);
+        return NULL;
+    }
+    j->filename = filename;
+    j->size = ftell(j->fp);
+    if (j->size == 0) {
+        memset(hdr,0,sizeof(hdr));
+        memcpy(hdr,JNL_MAGIC,sizeof(JNL_MAGIC));
+        putU32(hdr+8,JNL_VERSION);
+        putU32(hdr+12,BIN_RECORD_SIZE);
+        fwrite(hdr,sizeof(hdr),1,j->fp);
+        j->size = sizeof(hdr);
+    }
+    j->deltas = JNL_SNAPSHOT_EVERY;
+    j->count = count;
+    j->inuse = 0;
+    j->last = malloc((size_t)BIN_RECORD_SIZE*count);
+    j->buf = malloc(JNL_RECORD_HEADER+(size_t)JNL_ENTRY_SIZE*count+4);
+    return j;
+}
+
+/* Rewrite the journal with just the record of 'len' bytes in j->buf, that
+ * must be a snapshot. */
+void journalCompact(struct journal *j, size_t len) {
+    char tmpname[PATH_MAX];
+    unsigned char hdr[JNL_HEADER_SIZE];
+    FILE *fp;
+
+    fclose(j->fp);
+    if ((fp = openTemp(j->filename,tmpname,"wb")) != NULL) {
+        memset(hdr,0,sizeof(hdr));
+        memcpy(hdr,JNL_MAGIC,sizeof(JNL_MAGIC));
+        putU32(hdr+8,JNL_VERSION);
+        putU32(hdr+12,BIN_RECORD_SIZE);
+        fwrite(hdr,sizeof(hdr),1,fp);
+        fwrite(j->buf,len,1,fp);
+        commitTemp(fp,tmpname,j->filename);
+    }
+    if ((j->fp = fopen(j->filename,"ab")) == NULL) {
+        perror(j->filename);
+        exit(1);
+    }
+    j->size = ftell(j->fp);
+}
+
+/* Append the solution 'rs' with the state 'st' to the journal, as the list
+ * of the shapes changed since the previous record. */
+void journalAppend(struct journal *j, struct triangles *rs, struct globalState *st) {
+    unsigned char rec[BIN_RECORD_SIZE], *p = j->buf+JNL_RECORD_HEADER;
+    int i, n = 0, snapshot;
+    uint32_t fbits;
+    size_t len;
+
+    /* Write a snapshot if it's time to, or if it's not larger than the
+     * delta. */
+    snapshot = j->deltas >= JNL_SNAPSHOT_EVERY;
+    for (i = 0; i < rs->inuse && !snapshot; i++) {
+        putShape(rec,&rs->triangles[i]);
+        if (i < j->inuse && !memcmp(rec,j->last+i*BIN_RECORD_SIZE,BIN_RECORD_SIZE))
+            continue;
+        putU32(p,i);
+        memcpy(p+4,rec,BIN_RECORD_SIZE);
+        p += JNL_ENTRY_SIZE;
+        n++;
+    }
+    if (n == rs->inuse && n != 0) snapshot = 1;
+    if (snapshot) {
+        p = j->buf+JNL_RECORD_HEADER;
+        for (i = 0; i < rs->inuse; i++) {
+            putU32(p,i);
+            putShape(p+4,&rs->triangles[i]);
+            p += JNL_ENTRY_SIZE;
+        }
+        n = rs->inuse;
+        j->deltas = 0;
+    } else {
+        j->deltas++;
+    }
+
+    memset(j->buf,0,JNL_RECORD_HEADER);
+    j->buf[0] = snapshot ? JNL_SNAPSHOT : JNL_DELTA;
+    putU32(j->buf+4,n);
+    putU64(j->buf+8,st->generation);
+    memcpy(&fbits,&st->absbestdiff,4); putU32(j->buf+16,fbits);
+    memcpy(&fbits,&st->temperature,4); putU32(j->buf+20,fbits);
+    putU32(j->buf+24,st->max_shapes);
+    putU32(j->buf+28,st->max_shapes_incremental);
+    putU32(j->buf+32,rs->inuse);
+    len = p-j->buf;
+    putU32(p,crc32Update(0,j->buf,len));
+    len += 4;
+
+    /* Remember what was written, to compute the next delta. */
+    for (i = 0; i < rs->inuse; i++)
+        putShape(j->last+i*BIN_RECORD_SIZE,&rs->triangles[i]);
+    j->inuse = rs->inuse;
+
+    if (snapshot && opt_journal_max_size && j->size+(long long)len > opt_journal_max_size) {
+        journalCompact(j,len);
+    } else {
+        fwrite(j->buf,len,1,j->fp);
+        j->size += len;
+    }
+}
+
+/* Make sure everything appended so far reached the disk. */
+void journalFlush(struct journal *j) {
+    if (fflush(j->fp) == EOF || fsync(fileno(j->fp)) == -1)
+        fprintf(stderr,"Error writing %s\n", j->filename);
+}
+
+void journalClose(struct journal *j) {
+    if (j == NULL) return;
+    journalFlush(j);
+    fclose(j->fp);
+    free(j->last);
+    free(j->buf);
+    free(j);
+}
+
+/* Replay the journal 'filename' into 'triangles' and the state 'st'. If
+ * 'dump' is not NULL, every record is also logged to it as a JSON line.
+ * A truncated or corrupted tail, like the one left by a crash in the
+ * middle of an append, is removed from the file.
+ * Returns 1 if the state was loaded, 0 if there is no such journal or it
+ * has no records. */
+int journalLoad(char *filename, struct triangles *triangles, struct globalState *st, FILE *dump) {
+    int fd = open(filename,O_RDONLY);
+    const unsigned char *buf, *p;
+    struct stat sb;
+    size_t len, off, reclen;
+    uint32_t n, inuse, maxshapes, fbits, i;
+    long long records = 0;
+    int loaded = 0;
+
+    if (fd == -1) return 0;
+    if (fstat(fd,&sb) == -1) goto loaderr;
+    len = sb.st_size;
+    if (len == 0) {
+        close(fd);
+        return 0;
+    }
+    buf = mmap(NULL,len,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (buf == MAP_FAILED) goto loaderr;
+    if (len < JNL_HEADER_SIZE || memcmp(buf,JNL_MAGIC,sizeof(JNL_MAGIC)) ||
+        getU32(buf+12) < BIN_RECORD_SIZE) goto loaderr;
+    if (getU32(buf+8) > JNL_VERSION) {
+        fprintf(stderr,"Journal version %u not supported\n", getU32(buf+8));
+        exit(1);
+    }
+    reclen = getU32(buf+12);
+
+    off = JNL_HEADER_SIZE;
+    while(off+JNL_RECORD_HEADER+4 <= len) {
+        p = buf+off;
+        n = getU32(p+4);
+        maxshapes = getU32(p+24);
+        inuse = getU32(p+32);
+        if ((p[0] != JNL_SNAPSHOT && p[0] != JNL_DELTA) ||
+            maxshapes == 0 || maxshapes > BIN_MAX_SHAPES ||
+            inuse > maxshapes || n > inuse ||
+            (len-off-JNL_RECORD_HEADER-4)/(4+reclen) < n) break;
+        if (p[0] == JNL_DELTA && !loaded) break;
+        if (getU32(p+JNL_RECORD_HEADER+n*(4+reclen)) !=
+            crc32Update(0,p,JNL_RECORD_HEADER+n*(4+reclen))) break;
+        for (i = 0; i < n; i++)
+            if (getU32(p+JNL_RECORD_HEADER+i*(4+reclen)) >= inuse) break;
+        if (i != n) break;
+
+        if (!loaded || (int)maxshapes != triangles->count) {
+            struct triangle *t = malloc(sizeof(struct triangle)*maxshapes);
+
+            if (loaded) {
+                memcpy(t,triangles->triangles,sizeof(struct triangle)*
+                    (triangles->inuse < (int)maxshapes ?
+                     triangles->inuse : (int)maxshapes));
+            }
+            free(triangles->triangles);
+            triangles->triangles = t;
+            triangles->count = maxshapes;
+        }
+        st->max_shapes = maxshapes;
+        st->max_shapes_incremental = getU32(p+28);
+        fbits = getU32(p+16); memcpy(&st->absbestdiff,&fbits,4);
+        fbits = getU32(p+20); memcpy(&st->temperature,&fbits,4);
+        st->generation = getU64(p+8);
+        triangles->inuse = inuse;
+        for (i = 0; i < n; i++) {
+            const unsigned char *e = p+JNL_RECORD_HEADER+i*(4+reclen);
+            getShape(e+4,&triangles->triangles[getU32(e)]);
+        }
+        if (dump) {
+            fprintf(dump,"{\"offset\":%zu,\"type\":\"%s\",\"generation\":%lld,"
+                         "\"diff\":%.6f,\"temperature\":%f,\"shapes\":%d,"
+                         "\"changed\":%u}\n",
+                off, p[0] == JNL_SNAPSHOT ? "snapshot" : "delta",
+                st->generation, st->absbestdiff, st->temperature,
+                triangles->inuse, n);
+        }
+        loaded = 1;
+        records++;
+        off += JNL_RECORD_HEADER+n*(4+reclen)+4;
+    }
+    munmap((void*)buf,len);
+
+    if (off != len) {
+        fprintf(stderr,"Discarding the last %zu bytes of the journal %s: "
+                       "truncated or corrupted\n", len-off, filename);
+        if (!dump && truncate(filename,off) == -1) perror(filename);
+    }
+    if (loaded) {
+        printf("Replayed %lld journal records, %d triangles\n", records,
+            triangles->inuse);
+        /* Let the program continue with the current number of triangles. */
+        st->max_shapes_incremental = triangles->inuse;
+    }
+    return loaded;
+
+loaderr:
+    fprintf(stderr, "Error loading the journal %s\n", filename);
+    exit(1);
+}
+
+/* The checkpointer saves the binary state and the SVG in a background
+ * thread, so that the evolution never waits for the disk: the evolution
+ * hands it a copy of the solution to save with checkpointSubmit(), that
+ * only takes the time of a memcpy(). If more solutions are submitted
+ * while a save is in progress, only the last one is saved. */
+struct checkpointer {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *binfile, *svgfile;
+    int width, height;
+    struct triangles *rs;       /* Last submitted solution. */
+    struct globalState st;      /* State submitted with it. */
+    long long version;          /* Incremented at every submission. */
+    long long saved;            /* Last version saved. */
+    long long savetime;         /* Time spent saving, in microseconds. */
+    int stop;                   /* Save what is pending, then exit. */
+};
+
+void *checkpointThread(void *arg) {
+    struct checkpointer *cp = arg;
+    struct triangles rs;
+    struct globalState st;
+    long long version, start;
+
+    rs.count = cp->rs->count;
+    rs.triangles = malloc(sizeof(struct triangle)*rs.count);
+    pthread_mutex_lock(&cp->lock);
+    while(1) {
+        while (cp->version == cp->saved && !cp->stop)
+            pthread_cond_wait(&cp->cond,&cp->lock);
+        if (cp->version == cp->saved) break;
+        version = cp->version;
+        rs.inuse = cp->rs->inuse;
+        memcpy(rs.triangles,cp->rs->triangles,sizeof(struct triangle)*rs.inuse);
+        st = cp->st;
+        pthread_mutex_unlock(&cp->lock);
+
+        start = ustime();
+        saveSvg(cp->svgfile,&rs,cp->width,cp->height);
+        if (cp->binfile) saveBinary(cp->binfile,&rs,&st);
+
+        pthread_mutex_lock(&cp->lock);
+        cp->saved = version;
+        cp->savetime += ustime()-start;
+    }
+    pthread_mutex_unlock(&cp->lock);
+    free(rs.triangles);
+    return NULL;
+}
+
+/* Start the checkpointer for solutions of up to 'count' shapes. If
+ * 'binfile' is NULL only the SVG is saved. */
+struct checkpointer *checkpointCreate(char *binfile, char *svgfile, int count, int width, int height) {
+    struct checkpointer *cp = malloc(sizeof(*cp));
+
+    cp->binfile = binfile;
+    cp->svgfile = svgfile;
+    cp->width = width;
+    cp->height = height;
+    cp->rs = malloc(sizeof(struct triangles));
+    cp->rs->count = count;
+    cp->rs->inuse = 0;
+    cp->rs->triangles = malloc(sizeof(struct triangle)*count);
+    cp->version = cp->saved = 0;
+    cp->savetime = 0;
+    cp->stop = 0;
+    pthread_mutex_init(&cp->lock,NULL);
+    pthread_cond_init(&cp->cond,NULL);
+    if (pthread_create(&cp->thread,NULL,checkpointThread,cp) != 0) {
+        perror("Creating the checkpoint thread");
+        exit(1);
+    }
+    return cp;
+}
+
+/* Hand a copy of the solution 'rs' and the state 'st' to the checkpointer,
+ * to be saved as soon as possible. */
+void checkpointSubmit(struct checkpointer *cp, struct triangles *rs, struct globalState *st) {
+    pthread_mutex_lock(&cp->lock);
+    cp->rs->inuse = rs->inuse;
+    memcpy(cp->rs->triangles,rs->triangles,sizeof(struct triangle)*rs->inuse);
+    cp->st = *st;
+    cp->version++;
+    pthread_cond_signal(&cp->cond);
+    pthread_mutex_unlock(&cp->lock);
+}
+
+/* Return the time spent saving since the last call, in microseconds. */
+long long checkpointTime(struct checkpointer *cp) {
+    long long t;
+
+    pthread_mutex_lock(&cp->lock);
+    t = cp->savetime;
+    cp->savetime = 0;
+    pthread_mutex_unlock(&cp->lock);
+    return t;
+}
+
+/* Wait for the pending save, if any, and stop the checkpointer. */
+void checkpointFree(struct checkpointer *cp) {
+    if (cp == NULL) return;
+    pthread_mutex_lock(&cp->lock);
+    cp->stop = 1;
+    pthread_cond_signal(&cp->cond);
+    pthread_mutex_unlock(&cp->lock);
+    pthread_join(cp->thread,NULL);
+    pthread_mutex_destroy(&cp->lock);
+    pthread_cond_destroy(&cp->cond);
+    freeTriangles(cp->rs);
+    free(cp);
+}
+
+/* Parse a time interval like "5s", "500ms", "2m" or "1h". A number without
+ * unit is taken as seconds. Return the interval in milliseconds, or -1 if
+ * the interval is not valid. */
+long long parseInterval(char *s) {
+    char *unit;
+    double v = strtod(s,&unit);
+
+    if (unit == s || v < 0) return -1;
+    if (*unit == '\0' || !strcmp(unit,"s")) return v*1000;
+    if (!strcmp(unit,"ms")) return v;
+    if (!strcmp(unit,"m")) return v*60000;
+    if (!strcmp(unit,"h")) return v*3600000;
+    return -1;
+}
+
+/* Return the element 'idx' of a comma separated list of numbers like
+ * "50000,20000", or the last one if the list is shorter. Return -1 if
+ * the list is not valid. */
+long long listValue(char *list, int idx) {
+    char *p = list, *end;
+    long long v = -1, n;
+    int j;
+
+    for (j = 0; ; j++) {
+        n = strtoll(p,&end,10);
+        if (end == p || n < 0) return -1;
+        if (j <= idx) v = n;
+        if (*end == '\0') return v;
+        if (*end != ',') return -1;
+        p = end+1;
+    }
+}
+
+/* Return a new image of half the size of the specified one, every pixel
+ * being the average of a 2x2 block of the original image. The size of the
+ * new image is stored in *dw and *dh. */
+unsigned char *downsampleImage(unsigned char *image, int width, int height, int *dw, int *dh) {
+    int w = width/2, h = height/2, x, y, k;
+    unsigned char *half;
+
+    if (w < 1) w = 1;
+    if (h < 1) h = 1;
+    half = malloc(w*h*3);
+    for (y = 0; y < h; y++) {
+        int y0 = y*2, y1 = (y*2+1 < height) ? y*2+1 : y*2;
+
+        for (x = 0; x < w; x++) {
+            int x0 = x*2, x1 = (x*2+1 < width) ? x*2+1 : x*2;
+
+            for (k = 0; k < 3; k++) {
+                half[(y*w+x)*3+k] =
+                    (image[(y0*width+x0)*3+k] + image[(y0*width+x1)*3+k] +
+                     image[(y1*width+x0)*3+k] + image[(y1*width+x1)*3+k] + 2)/4;
+            }
+        }
+    }
+    *dw = w;
+    *dh = h;
+    return half;
+}
+
+/* The state of a running evolution at a given resolution: the evaluator
+ * for the target image, the current and absolute best solutions, and the
+ * checkpointer periodically saving the absolute best one (NULL to never
+ * save it). */
+struct evolution {
+    struct globalState *st;     /* Generation, temperature, ... */
+    struct island *island;      /* Island running it, or NULL. */
+    struct evaluator *ev;
+    struct pool *pool;
+    struct triangles *best, *absbest;
+    float bestdiff;
+    struct viewer *viewer;
+    struct checkpointer *cp;
+    struct journal *journal;    /* Journal of the improvements, or NULL. */
+    int unsaved;                /* The absolute best changed since the save. */
+    long long lastsave;         /* Time of the last checkpoint, in ms. */
+    struct rng rng;             /* Random stream of the main thread. */
+    long long accepted;         /* Accepted candidates so far. */
+    struct timing timing;       /* Time spent by the evaluators so far. */
+    struct scheduler *sched;    /* Adaptive mutations scheduler, or NULL. */
+    float t0;                   /* Starting temperature, 0 = the current. */
+    long long schedstart;       /* When the schedule started, in ms. */
+    float schedtemp;            /* Temperature at 'schedstart'. */
+    long long schedaccepted;    /* Accepted candidates at the last update. */
+    double schedfactor;         /* Cooling per generation or per ms. */
+    float targetdiff;           /* Stop at this diff, 0 = never. */
+    long long deadline;         /* Stop at this time in ms, 0 = never. */
+    FILE *stats;                /* Where to log statistics, or NULL. */
+    struct statistics *sv;      /* Statistics collected so far. */
+};
+
+/* Statistics periodically logged as JSON lines by statsLog(). All the
+ * counters are reset every time they are logged. */
+struct statistics {
+    long long start;            /* Start of the current period, in ms. */
+    long long generation;       /* Generation at the start of the period. */
+    long long candidates, accepted, improved;
+    long long tried[MUT_KINDS];         /* Candidates with the kind. */
+    long long kaccepted[MUT_KINDS];     /* Accepted candidates with it. */
+    long long kimproved[MUT_KINDS];     /* Improving candidates with it. */
+    struct timing timing;       /* Evaluators timing at the period start. */
+};
+
+/* In the island model 'opt_islands' chains evolve independently, in their
+ * own threads, with different seeds and starting temperatures, so that
+ * they explore different regions of the solutions space. Every
+ * 'opt_migration_interval' generations every island publishes its
+ * absolute best solution into the archipelago, and the weakest islands
+ * continue from the best solution found so far by any island. */
+struct archipelago {
+    pthread_mutex_t lock;
+    int count;                  /* Number of islands. */
+    int migrants;               /* How many of the weakest islands migrate. */
+    struct island *islands;
+    float *diff;                /* Last diff published by every island. */
+    struct triangles *best;     /* Best solution published so far. */
+    struct globalState beststate; /* State of the island that found it. */
+    float bestdiff;
+    int bestisland;
+    long long version;          /* Incremented every time 'best' changes. */
+    int finished;               /* Islands that completed their generations. */
+};
+
+struct island {
+    int id;
+    pthread_t thread;
+    struct archipelago *arch;
+    struct globalState state;
+    struct evolution e;
+    long long maxgen;           /* Generations to run, 0 = forever. */
+};
+
+/* Publish the absolute best solution of the island running 'e', and if the
+ * island is one of the weakest, replace its solution with the best one. */
+void migrate(struct evolution *e) {
+    struct island *is = e->island;
+    struct archipelago *a = is->arch;
+    struct globalState *st = e->st;
+    int j, rank = 0, adopt;
+
+    pthread_mutex_lock(&a->lock);
+    a->diff[is->id] = st->absbestdiff;
+    if (st->absbestdiff < a->bestdiff) {
+        a->best->inuse = e->absbest->inuse;
+        memcpy(a->best->triangles,e->absbest->triangles,
+            sizeof(struct triangle)*a->best->count);
+        a->bestdiff = st->absbestdiff;
+        a->beststate = *st;
+        a->bestisland = is->id;
+        a->version++;
+    }
+    for (j = 0; j < a->count; j++)
+        if (a->diff[j] < a->diff[is->id]) rank++;
+    adopt = rank >= a->count - a->migrants && a->bestdiff < st->absbestdiff;
+    if (adopt) {
+        e->best->inuse = e->absbest->inuse = a->best->inuse;
+        memcpy(e->best->triangles,a->best->triangles,
+            sizeof(struct triangle)*a->best->count);
+        memcpy(e->absbest->triangles,a->best->triangles,
+            sizeof(struct triangle)*a->best->count);
+        e->bestdiff = st->absbestdiff = a->diff[is->id] = a->bestdiff;
+    }
+    pthread_mutex_unlock(&a->lock);
+    if (adopt) evaluatorReset(e->ev,e->best);
+}
+
+/* Move the time spent by the candidates of the evaluator into the
+ * evolution timing. */
+void collectTiming(struct evolution *e) {
+    int j;
+
+    for (j = 0; j < e->ev->numcand; j++) {
+        struct timing *tm = &e->ev->cand[j]->timing;
+
+        e->timing.mutate += tm->mutate;
+        e->timing.draw += tm->draw;
+        e->timing.diff += tm->diff;
+        e->timing.pixels += tm->pixels;
+        memset(tm,0,sizeof(*tm));
+    }
+}
+
+/* Start a new statistics period. */
+void statsReset(struct evolution *e) {
+    struct statistics *sv = e->sv;
+
+    memset(sv,0,sizeof(*sv));
+    sv->start = mstime();
+    sv->generation = e->st->generation;
+    sv->timing = e->timing;
+}
+
+/* Log the statistics of the current period as a JSON line, and start
+ * a new period. Rates are relative to the period, the generation and
+ * the diffs are the current ones. Times are in seconds, summed across
+ * threads. */
+void statsLog(struct evolution *e) {
+    struct statistics *sv = e->sv;
+    long long now = mstime();
+    long long gens = e->st->generation - sv->generation;
+    long long cptime = 0;
+    double secs = (double)(now - sv->start)/1000;
+    FILE *fp = e->stats;
+    int k;
+
+    collectTiming(e);
+    if (e->cp) cptime = checkpointTime(e->cp);
+    flockfile(fp);
+    fprintf(fp,"{\"time\":%lld,", now);
+    if (e->island) fprintf(fp,"\"island\":%d,", e->island->id);
+    fprintf(fp,"\"width\":%d,\"height\":%d,\"generation\":%lld,"
+               "\"generations_per_sec\":%.1f,\"diff\":%.6f,"
+               "\"absbestdiff\":%.6f,\"temperature\":%f,\"shapes\":%d,"
+               "\"mutate_sec\":%.3f,\"draw_sec\":%.3f,\"diff_sec\":%.3f,"
+               "\"checkpoint_sec\":%.3f,\"pixels_per_candidate\":%.1f,"
+               "\"accept_rate\":%.4f,\"improve_rate\":%.4f,\"kinds\":{",
+        e->ev->width, e->ev->height, e->st->generation,
+        secs > 0 ? gens/secs : 0,
+        e->bestdiff, e->st->absbestdiff, e->st->temperature, e->best->inuse,
+        (double)(e->timing.mutate-sv->timing.mutate)/1000000,
+        (double)(e->timing.draw-sv->timing.draw)/1000000,
+        (double)(e->timing.diff-sv->timing.diff)/1000000,
+        (double)cptime/1000000,
+        sv->candidates ?
+            (double)(e->timing.pixels-sv->timing.pixels)/sv->candidates : 0,
+        sv->candidates ? (double)sv->accepted/sv->candidates : 0,
+        sv->candidates ? (double)sv->improved/sv->candidates : 0);
+    for (k = 0; k < MUT_KINDS; k++) {
+        fprintf(fp,"%s\"%s\":{\"tried\":%lld,\"accept_rate\":%.4f,"
+                   "\"improve_rate\":%.4f}",
+            k ? "," : "", mutationKindNames[k], sv->tried[k],
+            sv->tried[k] ? (double)sv->kaccepted[k]/sv->tried[k] : 0,
+            sv->tried[k] ? (double)sv->kimproved[k]/sv->tried[k] : 0);
+    }
+    fprintf(fp,"}}\n");
+    fflush(fp);
+    funlockfile(fp);
+    statsReset(e);
+}
+
+/* Lower the temperature according to the annealing schedule. Called at
+ * every generation. */
+void coolDown(struct evolution *e) {
+    struct globalState *st = e->st;
+
+    if (opt_schedule == SCHEDULE_LINEAR) {
+        if (st->temperature > 0 && !(st->generation % 10)) {
+            st->temperature -= 0.00001;
+            if (st->temperature < 0) st->temperature = 0;
+        }
+    } else if (opt_schedule == SCHEDULE_EXPONENTIAL) {
+        st->temperature *= e->schedfactor;
+    } else if (opt_schedule == SCHEDULE_TIME) {
+        /* Reading the clock every generation would cost more than the
+         * cooling is worth, so the temperature is updated every 100. */
+        if (!(st->generation % 100)) {
+            st->temperature = e->schedtemp *
+                exp((mstime()-e->schedstart)*e->schedfactor);
+        }
+    } else if (opt_schedule == SCHEDULE_ACCEPTANCE) {
+        /* Every 1000 generations move the temperature toward the one
+         * accepting the target ratio of the candidates. */
+        if (!(st->generation % 1000)) {
+            float ratio = (float)(e->accepted - e->schedaccepted)/1000;
+
+            st->temperature *= (ratio > opt_target_acceptance) ? 0.9 : 1.1;
+            if (st->temperature > e->t0) st->temperature = e->t0;
+            if (st->temperature < 1e-6) st->temperature = 1e-6;
+            e->schedaccepted = e->accepted;
+        }
+    }
+}
+
+/* Evolve the current solution using simulated annealing. Stops after
+ * 'maxgen' generations, or after 'plateau' generations without finding a
+ * new absolute best solution. Zero means no limit for both. It also stops
+ * when the absolute best diff reaches e->targetdiff, or at e->deadline,
+ * if set. */
+void evolve(struct evolution *e, long long maxgen, long long plateau) {
+    struct globalState *st = e->st;
+    struct evaluator *ev = e->ev;
+    struct triangles *best = e->best, *absbest = e->absbest;
+    struct candidate *c;
+    long long startgen = st->generation;
+    long long lastbest = st->generation;
+    long long lastplateau = st->generation;
+    float percdiff, limit;
+    int j, k;
+
+    if (e->t0 == 0) {
+        e->t0 = st->temperature > 0 ? st->temperature : INITIAL_TEMPERATURE;
+        e->schedstart = mstime();
+        e->schedtemp = e->t0;
+        e->schedaccepted = e->accepted;
+        /* Temperature multiplier per generation for the exponential
+         * schedule, exponent per millisecond for the time one. */
+        if (opt_schedule == SCHEDULE_EXPONENTIAL)
+            e->schedfactor = pow(0.5,1.0/opt_halflife_value);
+        else if (opt_schedule == SCHEDULE_TIME)
+            e->schedfactor = log(0.5)/opt_halflife_value;
+        /* Only the linear schedule continues a run that already cooled. */
+        if (opt_schedule != SCHEDULE_LINEAR && st->temperature == 0)
+            st->temperature = e->t0;
+    }
+
+    while(1) {
+        if (maxgen && st->generation - startgen >= maxgen) break;
+        if (plateau && st->generation - lastbest >= plateau) break;
+        if (e->targetdiff > 0 && st->absbestdiff <= e->targetdiff) break;
+        if (e->deadline && (st->generation % 100) == 0 &&
+            mstime() >= e->deadline) break;
+        st->generation++;
+        coolDown(e);
+
+        /* When stuck on a plateau, reheat and/or restart from the absolute
+         * best solution instead of wandering far from it. */
+        if (opt_plateau_generations &&
+            st->generation - lastbest >= opt_plateau_generations &&
+            st->generation - lastplateau >= opt_plateau_generations)
+        {
+            if ((opt_plateau_action & PLATEAU_REHEAT) &&
+                st->temperature < opt_reheat_temperature)
+            {
+                st->temperature = opt_reheat_temperature;
+                e->schedstart = mstime();
+                e->schedtemp = st->temperature;
+            }
+            if ((opt_plateau_action & PLATEAU_JUMP) &&
+                e->bestdiff > st->absbestdiff)
+            {
+                best->inuse = absbest->inuse;
+                memcpy(best->triangles,absbest->triangles,
+                    sizeof(struct triangle)*best->count);
+                e->bestdiff = st->absbestdiff;
+                evaluatorReset(ev,best);
+            }
+            lastplateau = st->generation;
+        }
+
+        /* From time to time allow the current solution to use one more
+         * triangle, up to the configured max number. */
+        if ((st->generation % 1000) == 0) {
+            if (st->max_shapes_incremental < best->count &&
+                best->inuse > st->max_shapes_incremental-1)
+            {
+                st->max_shapes_incremental++;
+            }
+        }
+
+        /* Copy what is currenly the best solution, and mutate it, then
+         * draw the mutated solution and check what is its fitness.
+         * In our case the fitness is the difference bewteen the target
+         * image and our image. Only the area touched by the mutation
+         * is actually redrawn and compared.
+         *
+         * With multiple threads, every thread creates and scores its own
+         * candidate, and only the best one is considered. */
+        /* Candidates can only be accepted if their diff is less than the
+         * current one, or if they are within 2*temperature of the absolute
+         * best one: there is no point in completing the evaluation of the
+         * others. */
+        limit = e->bestdiff;
+        if (st->temperature > 0 && st->absbestdiff+2*st->temperature > limit)
+            limit = st->absbestdiff+2*st->temperature;
+        ev->limit = percToDiff(limit,ev->width,ev->height);
+        ev->maxinuse = st->max_shapes_incremental;
+        ev->sched = e->sched;
+        poolRun(e->pool,generateCandidate,ev);
+        c = bestCandidate(ev);
+
+        /* Teach the scheduler how much every kind of mutation paid off. */
+        if (e->sched) {
+            for (j = 0; j < ev->numcand; j++) {
+                struct candidate *o = ev->cand[j];
+
+                if (o->m.kinds == 0) continue;
+                schedulerUpdate(e->sched,__builtin_ctz(o->m.kinds),
+                    o->diff < ev->diff ? ev->diff - o->diff : 0, o->evaltime);
+            }
+            schedulerUpdateProbs(e->sched);
+        }
+        if (e->stats) {
+            for (j = 0; j < ev->numcand; j++) {
+                e->sv->candidates++;
+                for (k = 0; k < MUT_KINDS; k++)
+                    if (ev->cand[j]->m.kinds & (1<<k)) e->sv->tried[k]++;
+            }
+        }
+
+        /* The percentage of difference is calculate taking the ratio between
+         * the maximum difference and the current difference. */
+        percdiff = diffToPerc(c->diff,ev->width,ev->height);
+        if (percdiff < e->bestdiff ||
+            (st->temperature > 0 &&
+             rngFloat(&e->rng) < st->temperature &&
+             (percdiff-st->absbestdiff) < 2*st->temperature))
+        {
+            /* Save what is currently our "best" solution, even if actually
+             * this may be a jump backward depending on the temperature.
+             * It will be used as a base of the next iteration. */
+            acceptCandidate(ev,c);
+
+            if (percdiff < e->bestdiff) {
+                /* We always save a copy of the absolute best solution we found
+                 * so far, after some generation without finding anything better
+                 * we may jump back to that solution.
+                 *
+                 * We also use the absolute best solution to save the program
+                 * state in the binary file, and as SVG output. */
+                absbest->inuse = best->inuse;
+                memcpy(absbest->triangles,best->triangles,
+                    sizeof(struct triangle)*best->inuse);
+                if (percdiff < st->absbestdiff)
+                    lastbest = st->generation;
+                st->absbestdiff = percdiff;
+                e->unsaved = 1;
+                if (e->journal) journalAppend(e->journal,absbest,st);
+            }
+
+            e->accepted++;
+            if (e->stats) {
+                e->sv->accepted++;
+                if (percdiff < e->bestdiff) e->sv->improved++;
+                for (k = 0; k < MUT_KINDS; k++) {
+                    if (!(c->m.kinds & (1<<k))) continue;
+                    e->sv->kaccepted[k]++;
+                    if (percdiff < e->bestdiff) e->sv->kimproved[k]++;
+                }
+            }
+            if (!opt_bench && !opt_batch && !opt_tiles && !opt_sequence &&
+                !e->island)
+            {
+                printf("Diff is %f%% (inuse:%d, max:%d, gen:%lld, temp:%f)\n",
+                    percdiff,
+                    best->inuse,
+                    st->max_shapes_incremental,
+                    st->generation,
+                    st->temperature);
+            }
+
+            e->bestdiff = percdiff;
+            viewerUpdate(e->viewer,ev->bestfb,ev->width,ev->height,1);
+        } else {
+            viewerUpdate(e->viewer,ev->bestfb,ev->width,ev->height,0);
+        }
+        /* Discard all the other candidates. Rejecting the accepted one is
+         * a no-op, since its dirty area is now part of the best solution. */
+        for (j = 0; j < ev->numcand; j++)
+            rejectCandidate(ev,ev->cand[j]);
+
+        /* From time to time save the current state into a binary save
+         * and produce an SVG of the current solution, if it changed. */
+        if (e->cp && e->unsaved && (st->generation % 100) == 0 &&
+            mstime()-e->lastsave >= opt_checkpoint_interval)
+        {
+            checkpointSubmit(e->cp,absbest,st);
+            if (e->journal) journalFlush(e->journal);
+            e->unsaved = 0;
+            e->lastsave = mstime();
+        }
+
+        if (e->stats && (st->generation % 100) == 0 &&
+            mstime()-e->sv->start >= opt_stats_interval) statsLog(e);
+
+        /* Exchange solutions with the other islands. */
+        if (e->island && (st->generation % opt_migration_interval) == 0)
+            migrate(e);
+    }
+
+    /* Collect the time spent by the candidates. */
+    collectTiming(e);
+}
+
+void *islandThread(void *arg) {
+    struct island *is = arg;
+
+    evolve(&is->e,is->maxgen,0);
+    migrate(&is->e);
+    pthread_mutex_lock(&is->arch->lock);
+    is->arch->finished++;
+    pthread_mutex_unlock(&is->arch->lock);
+    return NULL;
+}
+
+/* Evolve 'opt_islands' chains starting from the solution 'rs', that is
+ * the one evolved by 'e' so far. Every island runs 'maxgen' generations,
+ * or forever if it is zero. The main thread shows and saves the best
+ * solution of all the islands every time it changes.
+ *
+ * On return, that only happens if 'maxgen' is not zero, 'e' describes the
+ * the work of all the islands, and its best solution is the best found. */
+void evolveIslands(struct evolution *e, unsigned char *image, int width, int height, struct triangles *rs, long long maxgen) {
+    struct archipelago a;
+    unsigned char *fb = malloc(width*height*3);
+    struct rect all = {0, 0, width-1, height-1};
+    long long version = 0, savedversion = 0;
+    int j, finished;
+
+    pthread_mutex_init(&a.lock,NULL);
+    a.count = opt_islands;
+    a.migrants = opt_islands/4 ? opt_islands/4 : 1;
+    a.islands = malloc(sizeof(struct island)*a.count);
+    a.diff = malloc(sizeof(float)*a.count);
+    a.best = mkRandomtriangles(&e->rng,rs->count,width,height);
+    a.best->inuse = rs->inuse;
+    memcpy(a.best->triangles,rs->triangles,sizeof(struct triangle)*rs->count);
+    a.beststate = *e->st;
+    a.bestdiff = 100;
+    a.bestisland = 0;
+    a.version = 0;
+    a.finished = 0;
+
+    for (j = 0; j < a.count; j++) {
+        struct island *is = &a.islands[j];
+
+        is->id = j;
+        is->arch = &a;
+        is->maxgen = maxgen;
+        a.diff[j] = 100;
+
+        /* Every island starts with a different temperature, from half
+         * to one and half times the current one. */
+        is->state = *e->st;
+        is->state.generation = 0;
+        is->state.absbestdiff = 100;
+        is->state.temperature *= 0.5f + (float)j/(a.count-1);
+
+        is->e = *e;
+        is->e.st = &is->state;
+        is->e.island = is;
+        is->e.viewer = NULL;
+        is->e.cp = NULL;
+        is->e.journal = NULL;
+        is->e.accepted = 0;
+        is->e.t0 = 0;
+        if (is->e.sched) is->e.sched = schedulerCreate();
+        memset(&is->e.timing,0,sizeof(is->e.timing));
+        if (is->e.stats) {
+            is->e.sv = malloc(sizeof(struct statistics));
+            statsReset(&is->e);
+        }
+        rngSeed(&is->e.rng,opt_seed,j+1);
+        is->e.pool = poolCreate(opt_threads);
+        is->e.ev = evaluatorCreate(image,width,height,rs->count,opt_threads,
+            &is->e.rng);
+        is->e.best = mkRandomtriangles(&is->e.rng,rs->count,width,height);
+        is->e.absbest = mkRandomtriangles(&is->e.rng,rs->count,width,height);
+        is->e.best->inuse = is->e.absbest->inuse = rs->inuse;
+        memcpy(is->e.best->triangles,rs->triangles,
+            sizeof(struct triangle)*rs->count);
+        memcpy(is->e.absbest->triangles,rs->triangles,
+            sizeof(struct triangle)*rs->count);
+        is->e.bestdiff = 100;
+        evaluatorReset(is->e.ev,is->e.best);
     }
-    fwrite(&state,sizeof(state),1,fp);
-    fwrite(triangles,sizeof(*triangles),1,fp);
-    fwrite(triangles->triangles,sizeof(struct triangle)*triangles->inuse,1,fp);
-    fclose(fp);
+    for (j = 0; j < a.count; j++) {
+        if (pthread_create(&a.islands[j].thread,NULL,islandThread,
+            &a.islands[j]) != 0)
+        {
+            perror("Creating the island thread");
+            exit(1);
+        }
+    }
+
+    /* Show and save the best solution while the islands evolve. */
+    do {
+        int changed = 0;
+
+        usleep(100000);
+        pthread_mutex_lock(&a.lock);
+        finished = a.finished;
+        if (a.version != version) {
+            version = a.version;
+            rs->inuse = a.best->inuse;
+            memcpy(rs->triangles,a.best->triangles,
+                sizeof(struct triangle)*rs->count);
+            changed = 1;
+            if (e->journal) journalAppend(e->journal,a.best,&a.beststate);
+            if (e->cp && mstime()-e->lastsave >= opt_checkpoint_interval) {
+                checkpointSubmit(e->cp,a.best,&a.beststate);
+                if (e->journal) journalFlush(e->journal);
+                savedversion = version;
+                e->lastsave = mstime();
+            }
+            if (!opt_bench) {
+                printf("Diff is %f%% (island:%d, inuse:%d, gen:%lld, "
+                       "temp:%f)\n",
+                    a.bestdiff,
+                    a.bestisland,
+                    a.best->inuse,
+                    a.beststate.generation,
+                    a.beststate.temperature);
+            }
+        }
+        pthread_mutex_unlock(&a.lock);
+
+        if (changed && e->viewer) {
+            memset(fb,0,width*height*3);
+            drawtriangles(fb,width,&all,rs);
+        }
+        if (e->viewer) viewerUpdate(e->viewer,fb,width,height,changed);
+
+        /* A solution not saved because of the interval is saved later. */
+        if (e->cp && version != savedversion &&
+            mstime()-e->lastsave >= opt_checkpoint_interval)
+        {
+            pthread_mutex_lock(&a.lock);
+            checkpointSubmit(e->cp,a.best,&a.beststate);
+            pthread_mutex_unlock(&a.lock);
+            if (e->journal) journalFlush(e->journal);
+            savedversion = version;
+            e->lastsave = mstime();
+        }
+    } while(finished < a.count);
+
+    /* Collect the work of all the islands. */
+    for (j = 0; j < a.count; j++) {
+        struct island *is = &a.islands[j];
+
+        pthread_join(is->thread,NULL);
+        e->st->generation += is->state.generation;
+        e->accepted += is->e.accepted;
+        e->timing.mutate += is->e.timing.mutate;
+        e->timing.draw += is->e.timing.draw;
+        e->timing.diff += is->e.timing.diff;
+        evaluatorFree(is->e.ev);
+        poolFree(is->e.pool);
+        freeTriangles(is->e.best);
+        freeTriangles(is->e.absbest);
+        if (is->e.stats) free(is->e.sv);
+        free(is->e.sched);
+    }
+    rs->inuse = a.best->inuse;
+    memcpy(rs->triangles,a.best->triangles,sizeof(struct triangle)*rs->count);
+    e->bestdiff = a.bestdiff;
+    freeTriangles(a.best);
+    free(a.diff);
+    free(a.islands);
+    free(fb);
+    pthread_mutex_destroy(&a.lock);
 }
 
-/* Load a binary representation of a set of triangles and the program state. */
-void loadBinary(char *filename,struct triangles *triangles) {
-    FILE *fp = fopen(filename,"rb");
-    struct triangle *tarray;
+/* Print the results of the benchmark as a single line JSON object. Times
+ * are CPU seconds summed across threads, so with multiple threads their
+ * sum can be greater than the elapsed time. */
+void benchReport(struct evolution *e, char *filename, int width, int height, long long elapsed) {
+    float secs = (float)elapsed/1000000;
 
-    if (!fp) return; /* If there is no file we start with a clear state. */
+    printf("{\"image\":\"%s\",\"width\":%d,\"height\":%d,"
+           "\"threads\":%d,\"band_threads\":%d,\"simd\":\"%s\","
+           "\"span_simd\":\"%s\","
+           "\"generations\":%lld,\"seconds\":%.3f,"
+           "\"generations_per_sec\":%.1f,\"accept_rate\":%.4f,"
+           "\"final_diff\":%.6f,\"shapes\":%d,"
+           "\"mutate_sec\":%.3f,\"draw_sec\":%.3f,\"diff_sec\":%.3f}\n",
+        filename, width, height, opt_threads, opt_band_threads,
+        diffKernelName, spanKernelName,
+        e->st->generation, secs,
+        secs > 0 ? e->st->generation/secs : 0,
+        e->st->generation ? (float)e->accepted/e->st->generation : 0,
+        e->bestdiff, e->best->inuse,
+        (float)e->timing.mutate/1000000,
+        (float)e->timing.draw/1000000,
+        (float)e->timing.diff/1000000);
+}
 
-    /* Load the state structure, and the best solution. */
-    if (fread(&state,sizeof(state),1,fp) != 1) goto loaderr;
-    free(triangles->triangles);
-    if (fread(triangles,sizeof(*triangles),1,fp) != 1) goto loaderr;
-    if (triangles->inuse > state.max_shapes) {
-        fprintf(stderr,
-            "Can't load a binary image with more than %d triangles\n",
-            state.max_shapes);
-        exit(1);
+/* Evolve 'rs' against downsampled versions of the target image, from the
+ * coarsest level to the one just above the full resolution, so that the
+ * big shapes are placed in cheap generations, and only refined at the full
+ * resolution. At every level the absolute best solution is scaled up to
+ * seed the next one. On return 'rs' is expressed at the full resolution. */
+void evolvePyramid(struct evolution *e, unsigned char *image, int width, int height, int levels, struct triangles *rs) {
+    unsigned char **images = malloc(sizeof(unsigned char*)*levels);
+    int *w = malloc(sizeof(int)*levels), *h = malloc(sizeof(int)*levels);
+    int l;
+
+    /* Don't go below a minimal size where shapes can still be placed. */
+    while(levels > 1 && ((width>>(levels-1)) < 16 || (height>>(levels-1)) < 16))
+        levels--;
+    images[0] = image; w[0] = width; h[0] = height;
+    for (l = 1; l < levels; l++)
+        images[l] = downsampleImage(images[l-1],w[l-1],h[l-1],&w[l],&h[l]);
+
+    /* Express the initial solution in terms of the coarsest level. */
+    scaleTriangles(rs,1.0f/(1<<(levels-1)),w[levels-1],h[levels-1]);
+    for (l = levels-1; l > 0; l--) {
+        struct evolution le = *e;
+
+        if (!opt_batch && !opt_tiles) printf("Pyramid level %d: %dx%d\n", l, w[l], h[l]);
+        le.ev = evaluatorCreate(images[l],w[l],h[l],rs->count,opt_threads,
+            &le.rng);
+        le.best = rs;
+        le.absbest = mkRandomtriangles(&le.rng,rs->count,w[l],h[l]);
+        le.absbest->inuse = rs->inuse;
+        memcpy(le.absbest->triangles,rs->triangles,
+            sizeof(struct triangle)*rs->count);
+        le.bestdiff = e->st->absbestdiff = 100;
+        le.cp = NULL;
+        le.journal = NULL;
+        evaluatorReset(le.ev,rs);
+        evolve(&le,listValue(opt_level_generations,levels-1-l),
+                   listValue(opt_level_plateau,levels-1-l));
+        e->rng = le.rng;
+        e->accepted = le.accepted;
+        e->timing = le.timing;
+
+        /* Continue from the absolute best solution of this level, scaled
+         * to the next one. */
+        rs->inuse = le.absbest->inuse;
+        memcpy(rs->triangles,le.absbest->triangles,
+            sizeof(struct triangle)*rs->count);
+        scaleTriangles(rs,(float)w[l-1]/w[l],w[l-1],h[l-1]);
+        freeTriangles(le.absbest);
+        evaluatorFree(le.ev);
+        free(images[l]);
     }
-    printf("Loading %d triangles\n", triangles->inuse);
-    tarray = malloc(sizeof(struct triangle)*state.max_shapes);
-    if (fread(tarray,sizeof(struct triangle)*triangles->inuse,1,fp) != 1)
-        goto loaderr;
-    triangles->triangles = tarray;
-    triangles->count = state.max_shapes;
+    if (!opt_batch && !opt_tiles) printf("Pyramid level 0: %dx%d\n", width, height);
+    e->st->absbestdiff = 100;
+    free(images);
+    free(w);
+    free(h);
+}
 
-    /* Let the program continue with the current number of triangles. */
-    state.max_shapes_incremental = triangles->inuse;
+/* In batch mode many images are evolved by a fixed number of workers
+ * sharing the process, every one with its own pool of candidate threads.
+ * Every worker takes the next image of the batch, evolves it from scratch
+ * until the target diff or the time budget is reached, saves the binary
+ * state and the SVG, and moves to the next image. */
+#define BATCH_CIRCLE_RADIUS 1024 /* Circles spans table size in batch mode. */
+
+struct batch {
+    pthread_mutex_t lock;
+    int count;                  /* Number of images. */
+    char **png, **bin, **svg;   /* Input and outputs of every image. */
+    int next;                   /* Next image to evolve. */
+    int failed;                 /* Images that could not be evolved. */
+};
+
+/* Add an image to the batch. If 'bin' or 'svg' are NULL, the outputs are
+ * created in 'outdir', named after the image. */
+void batchAdd(struct batch *b, char *png, char *bin, char *svg, char *outdir) {
+    char path[PATH_MAX], *base, *dot;
+    int len;
+
+    b->png = realloc(b->png,sizeof(char*)*(b->count+1));
+    b->bin = realloc(b->bin,sizeof(char*)*(b->count+1));
+    b->svg = realloc(b->svg,sizeof(char*)*(b->count+1));
+    b->png[b->count] = strdup(png);
+    base = strrchr(png,'/');
+    base = base ? base+1 : png;
+    dot = strrchr(base,'.');
+    len = dot ? (int)(dot-base) : (int)strlen(base);
+    snprintf(path,sizeof(path),"%s/%.*s.bin",outdir,len,base);
+    b->bin[b->count] = strdup(bin ? bin : path);
+    snprintf(path,sizeof(path),"%s/%.*s.svg",outdir,len,base);
+    b->svg[b->count] = strdup(svg ? svg : path);
+    b->count++;
+}
+
+int batchCompare(const void *a, const void *b) {
+    return strcmp(*(char**)a,*(char**)b);
+}
+
+/* Create the batch of images to evolve from 'source', that is either a
+ * directory, whose .png files are evolved in name order, or a manifest:
+ * a text file with one image per line, optionally followed by the names
+ * of its binary and SVG outputs. Empty lines and lines starting with '#'
+ * are ignored. Return NULL on error. */
+struct batch *batchCreate(char *source, char *outdir) {
+    struct batch *b = malloc(sizeof(*b));
+    char line[PATH_MAX*3];
+    struct stat sb;
+    DIR *dir;
+    FILE *fp;
+
+    pthread_mutex_init(&b->lock,NULL);
+    b->count = b->next = b->failed = 0;
+    b->png = b->bin = b->svg = NULL;
+    if (stat(source,&sb) == -1) {
+        perror(source);
+        return NULL;
+    }
+    if (S_ISDIR(sb.st_mode)) {
+        struct dirent *de;
+        char **names = NULL;
+        int j, count = 0;
+
+        if ((dir = opendir(source)) == NULL) {
+            perror(source);
+            return NULL;
+        }
+        while((de = readdir(dir)) != NULL) {
+            size_t len = strlen(de->d_name);
+
+            if (len < 5 || strcasecmp(de->d_name+len-4,".png")) continue;
+            names = realloc(names,sizeof(char*)*(count+1));
+            names[count++] = strdup(de->d_name);
+        }
+        closedir(dir);
+        qsort(names,count,sizeof(char*),batchCompare);
+        for (j = 0; j < count; j++) {
+            snprintf(line,sizeof(line),"%s/%s",source,names[j]);
+            batchAdd(b,line,NULL,NULL,outdir);
+            free(names[j]);
+        }
+        free(names);
+    } else {
+        if ((fp = fopen(source,"r")) == NULL) {
+            perror(source);
+            return NULL;
+        }
+        while(fgets(line,sizeof(line),fp) != NULL) {
+            char *png = strtok(line," \t\r\n");
+            char *bin = strtok(NULL," \t\r\n");
+            char *svg = strtok(NULL," \t\r\n");
+
+            if (png == NULL || png[0] == '#') continue;
+            batchAdd(b,png,bin,svg,outdir);
+        }
+        fclose(fp);
+    }
+    return b;
+}
+
+void batchFree(struct batch *b) {
+    int j;
+
+    for (j = 0; j < b->count; j++) {
+        free(b->png[j]);
+        free(b->bin[j]);
+        free(b->svg[j]);
+    }
+    free(b->png);
+    free(b->bin);
+    free(b->svg);
+    pthread_mutex_destroy(&b->lock);
+    free(b);
+}
+
+/* Evolve 'image' from scratch, with the random stream 'stream' and the
+ * candidate threads 'pool', until the diff reaches 'opt_target_diff' or
+ * 'opt_time_budget' elapsed. The state starts from the global one, and
+ * is returned in 'st' together with the absolute best solution. */
+struct triangles *evolveImage(unsigned char *image, int width, int height, int stream, struct pool *pool, struct globalState *st) {
+    struct evolution e;
+    struct triangles *absbest;
+    long long start = mstime();
+
+    *st = state;
+    memset(&e,0,sizeof(e));
+    e.st = st;
+    e.pool = pool;
+    e.lastsave = start;
+    rngSeed(&e.rng,opt_seed,stream);
+    e.best = mkRandomtriangles(&e.rng,st->max_shapes,width,height);
+    e.best->inuse = st->max_shapes_incremental;
+    e.sched = (opt_scheduler == SCHED_ADAPTIVE) ? schedulerCreate() : NULL;
+    e.targetdiff = opt_target_diff;
+    e.deadline = opt_time_budget ? start+opt_time_budget : 0;
+    if (opt_pyramid > 1)
+        evolvePyramid(&e,image,width,height,opt_pyramid,e.best);
+    e.absbest = mkRandomtriangles(&e.rng,e.best->count,width,height);
+    e.absbest->inuse = e.best->inuse;
+    memcpy(e.absbest->triangles,e.best->triangles,
+        sizeof(struct triangle)*e.best->count);
+    e.bestdiff = 100;
+    e.ev = evaluatorCreate(image,width,height,e.best->count,pool->size,
+        &e.rng);
+    evaluatorReset(e.ev,e.best);
+    evolve(&e,0,0);
+
+    absbest = e.absbest;
+    evaluatorFree(e.ev);
+    freeTriangles(e.best);
+    free(e.sched);
+    return absbest;
+}
+
+/* Evolve the image 'idx' of the batch using the candidate threads 'pool'.
+ * Return 0 on success, -1 on error. */
+int batchJob(struct batch *b, int idx, struct pool *pool) {
+    struct globalState st;
+    struct triangles *absbest;
+    unsigned char *image;
+    int width, height, alpha, err = 0;
+    long long start = mstime();
+    FILE *fp;
+
+    if ((fp = fopen(b->png[idx],"rb")) == NULL) {
+        perror(b->png[idx]);
+        return -1;
+    }
+    image = PngLoad(fp,&width,&height,&alpha,opt_max_size);
     fclose(fp);
-    printf("Loaded\n");
-    return;
+    if (image == NULL) {
+        fprintf(stderr,"Can't load the image %s\n", b->png[idx]);
+        return -1;
+    }
 
-loaderr:
-    fprintf(stderr, "Error loading the binary file");
-    exit(1);
+    /* Every image has its own random stream, so that its result does not
+     * depend on the worker evolving it. */
+    absbest = evolveImage(image,width,height,idx+1,pool,&st);
+    if (saveBinary(b->bin[idx],absbest,&st) == -1 ||
+        saveSvg(b->svg[idx],absbest,width,height) == -1) err = -1;
+    printf("%s: diff %f%%, %d shapes, %lld generations in %.1f seconds\n",
+        b->png[idx], st.absbestdiff, absbest->inuse, st.generation,
+        (float)(mstime()-start)/1000);
+
+    freeTriangles(absbest);
+    free(image);
+    return err;
+}
+
+/* Main function of the batch workers: evolve the next image of the batch
+ * until there are no more. */
+void *batchWorker(void *arg) {
+    struct batch *b = arg;
+    struct pool *pool = poolCreate(opt_threads);
+
+    while(1) {
+        int idx;
+
+        pthread_mutex_lock(&b->lock);
+        idx = b->next < b->count ? b->next++ : -1;
+        pthread_mutex_unlock(&b->lock);
+        if (idx == -1) break;
+        if (batchJob(b,idx,pool) == -1) {
+            pthread_mutex_lock(&b->lock);
+            b->failed++;
+            pthread_mutex_unlock(&b->lock);
+        }
+    }
+    poolFree(pool);
+    return NULL;
+}
+
+/* Evolve all the images of the batch with 'opt_jobs' workers. Return the
+ * number of images that could not be evolved. */
+int evolveBatch(struct batch *b) {
+    pthread_t *workers;
+    long long start = mstime();
+    int j, failed;
+
+    if (opt_jobs > b->count) opt_jobs = b->count;
+    printf("Evolving %d images with %d workers\n", b->count, opt_jobs);
+    workers = malloc(sizeof(pthread_t)*opt_jobs);
+    for (j = 0; j < opt_jobs; j++) {
+        if (pthread_create(&workers[j],NULL,batchWorker,b) != 0) {
+            perror("Creating the batch workers");
+            exit(1);
+        }
+    }
+    for (j = 0; j < opt_jobs; j++) pthread_join(workers[j],NULL);
+    free(workers);
+    failed = b->failed;
+    printf("Evolved %d images in %.1f seconds, %d failed\n",
+        b->count-failed, (float)(mstime()-start)/1000, failed);
+    return failed;
+}
+
+/* In sequence mode the image and SVG file names are printf() patterns like
+ * frames/%04d.png, and the numbered frames are evolved one after the
+ * other until a frame is missing. Every frame starts from the final
+ * solution of the previous one, so that it only needs a fraction of the
+ * generations of an evolution from scratch, and consecutive frames are
+ * made of the same shapes, that don't flicker. The first frame, unless
+ * the state file was loaded, gets ten times the generations of the
+ * others. After every frame its SVG is written, and the state file is
+ * overwritten with its solution: it is not a state of the whole sequence,
+ * but the starting point to continue it later with the next frames.
+ * The frames are shown by 'viewer' unless it is NULL.
+ * Return 0 on success, -1 on error. */
+int evolveSequence(char *pattern, char *binfile, char *svgpattern, struct viewer *viewer) {
+    struct evolution e;
+    struct globalState *st = &state;
+    unsigned char *image;
+    int width = 0, height = 0, w, h, alpha, frame, frames = 0, loaded = 0;
+    int err = 0;
+    long long start, maxgen, gens;
+    char path[PATH_MAX];
+    FILE *fp;
+
+    memset(&e,0,sizeof(e));
+    e.st = st;
+    e.pool = poolCreate(opt_threads);
+    e.sched = (opt_scheduler == SCHED_ADAPTIVE) ? schedulerCreate() : NULL;
+    e.targetdiff = opt_target_diff;
+    rngSeed(&e.rng,opt_seed,0);
+
+    frame = opt_first_frame;
+    if (frame == -1) {
+        snprintf(path,sizeof(path),pattern,0);
+        frame = access(path,R_OK) == 0 ? 0 : 1;
+    }
+    for (;; frame++) {
+        snprintf(path,sizeof(path),pattern,frame);
+        if ((fp = fopen(path,"rb")) == NULL) break;
+        image = PngLoad(fp,&w,&h,&alpha,opt_max_size);
+        fclose(fp);
+        if (image == NULL) {
+            fprintf(stderr,"Can't load the frame %s\n", path);
+            err = -1;
+            break;
+        }
+        if (frames == 0) {
+            width = w;
+            height = h;
+            if (opt_use_circles)
+                circleSpansInit(((width < height) ? width : height)/2);
+            e.best = mkRandomtriangles(&e.rng,st->max_shapes,width,height);
+            loaded = !opt_restart && loadBinary(binfile,e.best);
+            if (!loaded) e.best->inuse = st->max_shapes_incremental;
+            e.absbest = mkRandomtriangles(&e.rng,e.best->count,width,height);
+            e.viewer = viewer;
+            viewerOpen(viewer,image,width,height);
+        } else if (w != width || h != height) {
+            fprintf(stderr,"Frame %s is %dx%d, the sequence is %dx%d\n",
+                path, w, h, width, height);
+            free(image);
+            err = -1;
+            break;
+        }
+
+        /* Continue from the solution of the previous frame. */
+        start = mstime();
+        gens = st->generation;
+        maxgen = (frames == 0 && !loaded) ? opt_frame_generations*10 :
+                                            opt_frame_generations;
+        e.deadline = opt_time_budget ? start+opt_time_budget : 0;
+        e.absbest->inuse = e.best->inuse;
+        memcpy(e.absbest->triangles,e.best->triangles,
+            sizeof(struct triangle)*e.best->count);
+        e.bestdiff = st->absbestdiff = 100;
+        e.ev = evaluatorCreate(image,width,height,e.best->count,opt_threads,
+            &e.rng);
+        evaluatorReset(e.ev,e.best);
+        evolve(&e,maxgen,0);
+        e.best->inuse = e.absbest->inuse;
+        memcpy(e.best->triangles,e.absbest->triangles,
+            sizeof(struct triangle)*e.best->count);
+
+        evaluatorFree(e.ev);
+        free(image);
+        snprintf(path,sizeof(path),svgpattern,frame);
+        if (saveSvg(path,e.absbest,width,height) == -1 ||
+            saveBinary(binfile,e.absbest,st) == -1)
+        {
+            err = -1;
+            break;
+        }
+        printf("Frame %d: diff %f%%, %d shapes, %lld generations in %.1f "
+               "seconds\n", frame, st->absbestdiff, e.absbest->inuse,
+            st->generation-gens, (float)(mstime()-start)/1000);
+        frames++;
+    }
+    if (frames == 0 && err == 0) {
+        fprintf(stderr,"No frame found for %s\n", pattern);
+        err = -1;
+    }
+    if (err == 0) printf("Evolved %d frames\n", frames);
+
+    if (e.best) freeTriangles(e.best);
+    if (e.absbest) freeTriangles(e.absbest);
+    poolFree(e.pool);
+    free(e.sched);
+    return err;
+}
+
+/* In tiled mode the image is split into a grid of tiles of 'opt_tiles'
+ * pixels, and every tile is evolved as an independent image by the batch
+ * workers, with up to --max-shapes shapes. To avoid visible seams every
+ * tile is evolved together with a border of 'opt_tile_overlap' pixels of
+ * the neighbouring tiles, but only its own area is kept when stitching the
+ * tiles in the SVG. The memory used besides the image is the one of the
+ * 'opt_jobs' tiles evolving at any given time.
+ *
+ * The shapes of a tile usually extend beyond its own area, and only the
+ * SVG can clip them, so in tiled mode no state file is written. */
+struct tile {
+    struct rect core;           /* Area of the image owned by the tile. */
+    struct rect area;           /* Core plus the overlap, that is evolved. */
+    struct triangles *rs;       /* Solution in image coordinates. */
+    struct globalState st;      /* State of the evolution of the tile. */
+    long long diff;             /* Diff of the core in the stitched image. */
+};
+
+struct tiling {
+    pthread_mutex_t lock;
+    unsigned char *image;
+    int width, height;
+    int count;                  /* Number of tiles. */
+    struct tile *tiles;
+    int next;                   /* Next tile to evolve. */
+    int done;                   /* Tiles evolved so far. */
+};
+
+/* Evolve the tile 'idx' using the candidate threads 'pool'. */
+void tileJob(struct tiling *tl, int idx, struct pool *pool) {
+    struct tile *t = &tl->tiles[idx];
+    int w = t->area.x1-t->area.x0+1, h = t->area.y1-t->area.y0+1, y, done;
+    unsigned char *image = malloc((size_t)w*h*3);
+    unsigned char *fb = calloc((size_t)w*h,3);
+    long long start = mstime();
+    struct rect clip;
+
+    for (y = 0; y < h; y++)
+        memcpy(image+(size_t)y*w*3,
+               tl->image+((size_t)(t->area.y0+y)*tl->width+t->area.x0)*3,
+               (size_t)w*3);
+    t->rs = evolveImage(image,w,h,idx+1,pool,&t->st);
+
+    /* Only the core of the tile is part of the stitched image. */
+    clip.x0 = clip.y0 = 0;
+    clip.x1 = w-1;
+    clip.y1 = h-1;
+    drawtriangles(fb,w,&clip,t->rs);
+    t->diff = 0;
+    for (y = t->core.y0; y <= t->core.y1; y++) {
+        size_t off = ((size_t)(y-t->area.y0)*w+t->core.x0-t->area.x0)*3;
+
+        t->diff += computeDiff(fb+off,image+off,t->core.x1-t->core.x0+1,1);
+    }
+    translateTriangles(t->rs,t->area.x0,t->area.y0);
+    free(image);
+    free(fb);
+
+    pthread_mutex_lock(&tl->lock);
+    done = ++tl->done;
+    pthread_mutex_unlock(&tl->lock);
+    printf("Tile %d/%d at %d,%d: diff %f%%, %d shapes, %lld generations "
+           "in %.1f seconds\n", done, tl->count, t->core.x0, t->core.y0,
+        t->st.absbestdiff, t->rs->inuse, t->st.generation,
+        (float)(mstime()-start)/1000);
+}
+
+/* Main function of the tiles workers. */
+void *tileWorker(void *arg) {
+    struct tiling *tl = arg;
+    struct pool *pool = poolCreate(opt_threads);
+
+    while(1) {
+        int idx;
+
+        pthread_mutex_lock(&tl->lock);
+        idx = tl->next < tl->count ? tl->next++ : -1;
+        pthread_mutex_unlock(&tl->lock);
+        if (idx == -1) break;
+        tileJob(tl,idx,pool);
+    }
+    poolFree(pool);
+    return NULL;
+}
+
+/* Save the tiles as a single SVG, every tile clipped to its own area. */
+int saveTiledSvg(char *filename, struct tiling *tl) {
+    char tmpname[PATH_MAX];
+    FILE *fp = openTemp(filename,tmpname,"w");
+    int j;
+
+    if (!fp) return -1;
+    svgHeader(fp,tl->width,tl->height);
+    fprintf(fp,"<defs>\n");
+    for (j = 0; j < tl->count; j++) {
+        struct rect *r = &tl->tiles[j].core;
+
+        fprintf(fp,"<clipPath id=\"tile%d\"><rect x=\"%d\" y=\"%d\" "
+                   "width=\"%d\" height=\"%d\"/></clipPath>\n",
+            j, r->x0, r->y0, r->x1-r->x0+1, r->y1-r->y0+1);
+    }
+    fprintf(fp,"</defs>\n");
+    for (j = 0; j < tl->count; j++) {
+        fprintf(fp,"<g clip-path=\"url(#tile%d)\">\n", j);
+        svgShapes(fp,tl->tiles[j].rs);
+        fprintf(fp,"</g>\n");
+    }
+    fprintf(fp,"</svg>\n");
+    return commitTemp(fp,tmpname,filename);
+}
+
+/* Evolve 'image' tile by tile with 'opt_jobs' workers, then save the
+ * stitched solution as a single SVG. Return 0 on success, -1 on error. */
+int evolveTiles(unsigned char *image, int width, int height, char *svgfile) {
+    struct tiling tl;
+    pthread_t *workers;
+    long long start = mstime(), diff = 0;
+    int cols = (width+opt_tiles-1)/opt_tiles;
+    int rows = (height+opt_tiles-1)/opt_tiles;
+    int j, err = 0, shapes = 0;
+
+    pthread_mutex_init(&tl.lock,NULL);
+    tl.image = image;
+    tl.width = width;
+    tl.height = height;
+    tl.count = cols*rows;
+    tl.tiles = malloc(sizeof(struct tile)*tl.count);
+    tl.next = tl.done = 0;
+    for (j = 0; j < tl.count; j++) {
+        struct tile *t = &tl.tiles[j];
+
+        t->core.x0 = (j%cols)*opt_tiles;
+        t->core.y0 = (j/cols)*opt_tiles;
+        t->core.x1 = t->core.x0+opt_tiles-1;
+        t->core.y1 = t->core.y0+opt_tiles-1;
+        if (t->core.x1 >= width) t->core.x1 = width-1;
+        if (t->core.y1 >= height) t->core.y1 = height-1;
+        t->area.x0 = t->core.x0-opt_tile_overlap;
+        t->area.y0 = t->core.y0-opt_tile_overlap;
+        t->area.x1 = t->core.x1+opt_tile_overlap;
+        t->area.y1 = t->core.y1+opt_tile_overlap;
+        if (t->area.x0 < 0) t->area.x0 = 0;
+        if (t->area.y0 < 0) t->area.y0 = 0;
+        if (t->area.x1 >= width) t->area.x1 = width-1;
+        if (t->area.y1 >= height) t->area.y1 = height-1;
+    }
+
+    if (opt_jobs > tl.count) opt_jobs = tl.count;
+    printf("Evolving %d tiles of %dx%d pixels with %d workers\n",
+        tl.count, opt_tiles, opt_tiles, opt_jobs);
+    workers = malloc(sizeof(pthread_t)*opt_jobs);
+    for (j = 0; j < opt_jobs; j++) {
+        if (pthread_create(&workers[j],NULL,tileWorker,&tl) != 0) {
+            perror("Creating the tiles workers");
+            exit(1);
+        }
+    }
+    for (j = 0; j < opt_jobs; j++) pthread_join(workers[j],NULL);
+    free(workers);
+
+    /* Stitch the tiles. The cores of the tiles cover the image exactly
+     * once, so the diff of the stitched image is the sum of their diffs. */
+    for (j = 0; j < tl.count; j++) {
+        shapes += tl.tiles[j].rs->inuse;
+        diff += tl.tiles[j].diff;
+    }
+    if (saveTiledSvg(svgfile,&tl) == -1) err = -1;
+    printf("Evolved %d tiles in %.1f seconds, %d shapes, diff %f%%\n",
+        tl.count, (float)(mstime()-start)/1000, shapes,
+        diffToPerc(diff,width,height));
+
+    for (j = 0; j < tl.count; j++) freeTriangles(tl.tiles[j].rs);
+    free(tl.tiles);
+    pthread_mutex_destroy(&tl.lock);
+    return err;
 }
 
 void showHelp(char *progname) {
     fprintf(stderr,
         "Usage: %s <filename.png> <filename.bin> <filename.svg> [options]\n"
+        "       %s --batch <manifest or directory> <output directory> [options]\n"
         "\n"
         "--use-triangles   <0 or 1> default: 1.\n"
         "--use-circles     <0 or 1> default: 0.\n"
         "--max-shapes      <count> default: 64.\n"
         "--initial-shapes  <count> default: 1.\n"
         "--mutation-rate   <count> From 0 to 1000, default: 200\n"
+        "--scheduler       <fixed or adaptive> How mutations are picked, with\n"
+        "                  fixed probabilities (default), or adapting them to\n"
+        "                  the improvement per CPU time of every kind.\n"
+        "--schedule        <linear|exponential|time|acceptance> How the\n"
+        "                  temperature is lowered: by 0.00001 every 10\n"
+        "                  generations (default), halving it every --halflife\n"
+        "                  generations or time, or tuning it to accept\n"
+        "                  --target-acceptance of the candidates.\n"
+        "--halflife        <generations or time> default: 20000 or 60s.\n"
+        "--target-acceptance <ratio> default: 0.05.\n"
+        "--plateau-generations <count> After <count> generations without a\n"
+        "                  new absolute best, perform the plateau action.\n"
+        "                  Default: 0, never.\n"
+        "--plateau-action  <reheat|jump|both> Raise the temperature to the\n"
+        "                  reheat temperature, continue from the absolute best\n"
+        "                  solution (default), or both.\n"
+        "--reheat-temperature <temperature> default: 0.01.\n"
+        "--snapshot-every  <count> Cache a partial rendering every <count> shapes.\n"
+        "                  0 means automatic (default), -1 disables it.\n"
+        "--metric          <euclidean or sse> Pixel difference, default: euclidean.\n"
+        "--simd            <auto|avx512|avx2|ssse3|sse2|scalar> default: auto.\n"
+        "--threads         <count> Candidates evaluated in parallel at every\n"
+        "                  generation, one per thread, default: 1.\n"
+        "--band-threads    <count> Threads drawing and comparing horizontal bands\n"
+        "                  of every single candidate, default: 1.\n"
+        "--headless        Don't open a window showing the evolving image.\n"
+        "--fps             <count> Max refresh rate of the window, default: 30.\n"
+        "--pyramid         <levels> Evolve first against the image downsampled\n"
+        "                  levels-1 times, halving it at every level, then\n"
+        "                  refine at every finer level, default: 1 (disabled).\n"
+        "--level-generations <count,...> Max generations for every coarse\n"
+        "                  level, from the coarsest one, the last value\n"
+        "                  repeating for the next levels, default: 50000.\n"
+        "--level-plateau   <count,...> Move to the next level after <count>\n"
+        "                  generations without improvements, per level like\n"
+        "                  --level-generations, default: 5000.\n"
+        "--max-size        <pixels> Downsample the image while loading it, if\n"
+        "                  wider or taller, by an integer factor. Default: 0,\n"
+        "                  use the image as it is.\n"
         "--restart         Don't load the old state at startup.\n"
+        "--checkpoint-interval <time> Min time between saves of the state, like\n"
+        "                  500ms, 5s or 2m, default: 5s.\n"
+        "--stats           <filename> Append statistics to the file as JSON lines.\n"
+        "--stats-interval  <time> Time between statistics, default: 1s.\n"
+        "--journal         <filename> Append every improvement to the journal,\n"
+        "                  and load the state from it at startup. The binary\n"
+        "                  file is then only read if there is no journal.\n"
+        "--journal-max-size <bytes> Compact the journal, dropping the history,\n"
+        "                  when it grows beyond this size, default: 0 (never).\n"
+        "--journal-dump    Print the history in the journal as JSON lines and exit.\n"
+        "--islands         <count> Evolve <count> independent chains, every one\n"
+        "                  in its own thread, default: 1.\n"
+        "--migration-interval <count> Generations between the exchange of the\n"
+        "                  best solution among islands, default: 10000.\n"
+        "--seed            <number> Seed of the random numbers generator,\n"
+        "                  default: a different one at every run.\n"
+        "--bench           <generations> Run the specified number of generations\n"
+        "                  with a fixed seed, headless, without loading or\n"
+        "                  saving the state, then print the timings as JSON.\n"
+        "--jobs            <count> Batch mode: images evolved in parallel, every\n"
+        "                  one with --threads threads, default: one per core.\n"
+        "--target-diff     <perc> Batch mode: stop every image at this diff.\n"
+        "--time-budget     <time> Batch mode: max time for every image, like\n"
+        "                  30s or 5m. At least one of the two is required.\n"
+        "--sequence        Evolve a sequence of frames: the PNG and SVG file\n"
+        "                  names are patterns like frames/%%04d.png, and every\n"
+        "                  frame starts from the solution of the previous one.\n"
+        "                  The binary file is overwritten with the solution\n"
+        "                  of every frame, to continue the sequence later.\n"
+        "                  Not compatible with --stats, --islands, --bench,\n"
+        "                  --journal and --pyramid.\n"
+        "--first-frame     <number> First frame of the sequence, default: 0,\n"
+        "                  or 1 if there is no frame 0.\n"
+        "--frame-generations <count> Generations for every frame, default:\n"
+        "                  20000, ten times more for the first frame.\n"
+        "--tiles           <pixels> Split the image in tiles of this size,\n"
+        "                  evolved in parallel like the images of a batch,\n"
+        "                  every one with up to --max-shapes shapes, then\n"
+        "                  stitch them in the SVG. The shapes of the tiles\n"
+        "                  overlap, so no binary file is written: pass - as\n"
+        "                  its name.\n"
+        "--tile-overlap    <pixels> Border of the neighbouring tiles evolved\n"
+        "                  with every tile to hide the seams, default: 16.\n"
         "--help            Just show this help.\n"
-        ,progname);
+        "\n"
+        "In batch mode all the .png files of the directory, or the images listed\n"
+        "in the manifest, one per line, optionally followed by the names of the\n"
+        "binary and SVG outputs, are evolved from scratch. By default outputs are\n"
+        "written in the output directory, named after the image. Batch and\n"
+        "tiled modes don't support --stats, --islands, --bench and --journal.\n"
+        ,progname,progname);
     exit(1);
 }
 
-int main(int argc, char **argv)
-{
+/* Evolve the images of the selected mode, once the options are parsed.
+ * Return the exit code of the program. */
+int shapeme(char **argv, struct viewer *viewer) {
     FILE *fp;
     int width, height, alpha;
-    unsigned char *image, *fb;
-    SDL_Texture *texture;
-    SDL_Renderer *renderer;
-    struct triangles *triangles, *best, *absbest;
-    long long diff;
-    float percdiff, bestdiff;
+    unsigned char *image;
+    struct triangles *best, *absbest;
+    struct evolution e;
+    long long start;
+    int j;
+
+    /* Batch mode: evolve many images, every one from scratch, without
+     * a window and without periodic saves. */
+    if (opt_batch) {
+        struct batch *b;
+        int failed;
+
+        /* The spans table can't grow while the workers draw: larger
+         * circles are drawn without it. */
+        if (opt_use_circles) circleSpansInit(BATCH_CIRCLE_RADIUS);
+        printf("Using seed %llu\n", opt_seed);
+        if ((b = batchCreate(argv[2],argv[3])) == NULL) exit(1);
+        failed = evolveBatch(b);
+        batchFree(b);
+        return failed ? 1 : 0;
+    }
+
+    /* Sequence mode: evolve the frames one after the other. */
+    if (opt_sequence) {
+        if (!strchr(argv[1],'%') || !strchr(argv[3],'%')) {
+            fprintf(stderr,"In sequence mode the PNG and SVG file names "
+                           "must be patterns like frame%%04d.png.\n");
+            exit(1);
+        }
+        if (opt_frame_generations < 1) opt_frame_generations = 1;
+        printf("Using seed %llu\n", opt_seed);
+        return evolveSequence(argv[1],argv[2],argv[3],viewer) == -1;
+    }
+
+    /* Load the PNG in memory. */
+    fp = fopen(argv[1],"rb");
+    if (!fp) {
+        perror("Opening PNG file");
+        exit(1);
+    }
+    if ((image = PngLoad(fp,&width,&height,&alpha,opt_max_size)) == NULL) {
+        printf("Can't load the specified image.");
+        exit(1);
+    }
+
+    printf("Image %d %d, alpha:%d at %p\n", width, height, alpha, image);
+    fclose(fp);
+
+    /* Tiled mode: evolve the tiles from scratch, without a window, and
+     * save the stitched result. */
+    if (opt_tiles) {
+        if (width > SHRT_MAX || height > SHRT_MAX) {
+            fprintf(stderr,"Images larger than %d pixels can't be saved, "
+                           "use --max-size.\n", SHRT_MAX);
+            exit(1);
+        }
+        if (opt_use_circles) circleSpansInit(opt_tiles/2+opt_tile_overlap);
+        printf("Using seed %llu\n", opt_seed);
+        j = evolveTiles(image,width,height,argv[3]);
+        free(image);
+        return j == -1;
+    }
+    if (opt_use_circles)
+        circleSpansInit(((width < height) ? width : height)/2);
+
+    /* Allocate our array of triangles, and load the binary file if any.
+     * The pyramid is only used when starting from scratch. */
+    printf("Using seed %llu\n", opt_seed);
+    rngSeed(&e.rng,opt_seed,0);
+    best = mkRandomtriangles(&e.rng,state.max_shapes,width,height);
+    state.absbestdiff = 100;
+    if (opt_journal_dump) {
+        if (!opt_journal) {
+            fprintf(stderr,"--journal-dump requires --journal.\n");
+            exit(1);
+        }
+        return journalLoad(opt_journal,best,&state,stdout) ? 0 : 1;
+    }
+    if (opt_bench) opt_journal = NULL;
+    if (!opt_restart &&
+        ((opt_journal && journalLoad(opt_journal,best,&state,NULL)) ||
+         loadBinary(argv[2],best)))
+    {
+        opt_pyramid = 1;
+    } else {
+        best->inuse = state.max_shapes_incremental;
+    }
+    absbest = mkRandomtriangles(&e.rng,best->count,width,height);
+
+    e.st = &state;
+    e.island = NULL;
+    e.pool = poolCreate(opt_threads);
+    e.best = best;
+    e.absbest = absbest;
+    e.cp = opt_bench ? NULL :
+        checkpointCreate(opt_journal ? NULL : argv[2],argv[3],best->count,
+            width,height);
+    e.journal = NULL;
+    if (opt_journal &&
+        (e.journal = journalOpen(opt_journal,best->count,opt_restart)) == NULL)
+        exit(1);
+    e.unsaved = 0;
+    e.lastsave = mstime();
+    e.accepted = 0;
+    e.t0 = 0;
+    memset(&e.timing,0,sizeof(e.timing));
+    e.sched = (opt_scheduler == SCHED_ADAPTIVE) ? schedulerCreate() : NULL;
+    e.targetdiff = 0;
+    e.deadline = 0;
+    e.stats = NULL;
+    e.sv = NULL;
+    if (opt_stats) {
+        if ((e.stats = fopen(opt_stats,"a")) == NULL) {
+            perror(opt_stats);
+            exit(1);
+        }
+        e.sv = malloc(sizeof(struct statistics));
+        statsReset(&e);
+    }
+    start = ustime();
+
+    /* Open the viewer, that shows the real image for one second, then
+     * the evolving image. */
+    e.viewer = viewer;
+    viewerOpen(viewer,image,width,height);
+    if (opt_pyramid > 1)
+        evolvePyramid(&e,image,width,height,opt_pyramid,best);
+
+    if (opt_islands > 1) {
+        evolveIslands(&e,image,width,height,best,opt_bench);
+        if (opt_bench) benchReport(&e,argv[1],width,height,ustime()-start);
+        return 0;
+    }
+
+    absbest->inuse = best->inuse;
+    memcpy(absbest->triangles,best->triangles,
+        sizeof(struct triangle)*best->count);
+    e.bestdiff = 100;
+    e.ev = evaluatorCreate(image,width,height,best->count,opt_threads,&e.rng);
+    evaluatorReset(e.ev,best);
+    if (opt_bench) {
+        if (state.generation < opt_bench)
+            evolve(&e,opt_bench-state.generation,0);
+        benchReport(&e,argv[1],width,height,ustime()-start);
+        return 0;
+    }
+    evolve(&e,0,0);
+    return 0;
+}
+
+struct shapemeArgs {
+    char **argv;
+    struct viewer *viewer;
+    int retval;                 /* Value returned by shapeme(). */
+};
+
+void shapemeThread(void *arg) {
+    struct shapemeArgs *a = arg;
+
+    a->retval = shapeme(a->argv,a->viewer);
+}
+
+int main(int argc, char **argv)
+{
+    struct shapemeArgs args;
+    struct viewer *viewer;
+    int j;
 
     /* Initialization */
-    srand(time(NULL));
     state.max_shapes = 64;
     state.max_shapes_incremental = 1;
-    state.temperature = 0.10;
+    state.temperature = INITIAL_TEMPERATURE;
     state.generation = 0;
     state.absbestdiff = 100; /* 100% is worst diff possible. */
 
     /* Check arity and parse additional args if any. */
+    if (argc >= 2 && !strcmp(argv[1],"--batch")) opt_batch = 1;
     if (argc < 4) {
         showHelp(argv[0]);
         exit(1);
     }
 
     if (argc > 4) {
-        int j;
         for (j = 4; j < argc; j++) {
             int moreargs = j+1 < argc;
 
@@ -782,6 +4773,129 @@ int main(int argc, char **argv)
                 state.max_shapes_incremental = atoi(argv[++j]);
             } else if (!strcmp(argv[j],"--mutation-rate") && moreargs) {
                 opt_mutation_rate = atoi(argv[++j]);
+            } else if (!strcmp(argv[j],"--scheduler") && moreargs) {
+                j++;
+                if (!strcmp(argv[j],"fixed")) {
+                    opt_scheduler = SCHED_FIXED;
+                } else if (!strcmp(argv[j],"adaptive")) {
+                    opt_scheduler = SCHED_ADAPTIVE;
+                } else {
+                    fprintf(stderr,"Invalid scheduler.");
+                    showHelp(argv[0]);
+                }
+            } else if (!strcmp(argv[j],"--schedule") && moreargs) {
+                j++;
+                if (!strcmp(argv[j],"linear")) {
+                    opt_schedule = SCHEDULE_LINEAR;
+                } else if (!strcmp(argv[j],"exponential")) {
+                    opt_schedule = SCHEDULE_EXPONENTIAL;
+                } else if (!strcmp(argv[j],"time")) {
+                    opt_schedule = SCHEDULE_TIME;
+                } else if (!strcmp(argv[j],"acceptance")) {
+                    opt_schedule = SCHEDULE_ACCEPTANCE;
+                } else {
+                    fprintf(stderr,"Invalid schedule.");
+                    showHelp(argv[0]);
+                }
+            } else if (!strcmp(argv[j],"--halflife") && moreargs) {
+                opt_halflife = argv[++j];
+            } else if (!strcmp(argv[j],"--target-acceptance") && moreargs) {
+                opt_target_acceptance = atof(argv[++j]);
+            } else if (!strcmp(argv[j],"--plateau-generations") && moreargs) {
+                opt_plateau_generations = strtoll(argv[++j],NULL,10);
+            } else if (!strcmp(argv[j],"--reheat-temperature") && moreargs) {
+                opt_reheat_temperature = atof(argv[++j]);
+            } else if (!strcmp(argv[j],"--plateau-action") && moreargs) {
+                j++;
+                if (!strcmp(argv[j],"reheat")) {
+                    opt_plateau_action = PLATEAU_REHEAT;
+                } else if (!strcmp(argv[j],"jump")) {
+                    opt_plateau_action = PLATEAU_JUMP;
+                } else if (!strcmp(argv[j],"both")) {
+                    opt_plateau_action = PLATEAU_REHEAT|PLATEAU_JUMP;
+                } else {
+                    fprintf(stderr,"Invalid plateau action.");
+                    showHelp(argv[0]);
+                }
+            } else if (!strcmp(argv[j],"--snapshot-every") && moreargs) {
+                opt_snapshot_every = atoi(argv[++j]);
+            } else if (!strcmp(argv[j],"--metric") && moreargs) {
+                j++;
+                if (!strcmp(argv[j],"euclidean")) {
+                    opt_metric = METRIC_EUCLIDEAN;
+                } else if (!strcmp(argv[j],"sse")) {
+                    opt_metric = METRIC_SSE;
+                } else {
+                    fprintf(stderr,"Invalid metric.");
+                    showHelp(argv[0]);
+                }
+            } else if (!strcmp(argv[j],"--threads") && moreargs) {
+                opt_threads = atoi(argv[++j]);
+            } else if (!strcmp(argv[j],"--band-threads") && moreargs) {
+                opt_band_threads = atoi(argv[++j]);
+            } else if (!strcmp(argv[j],"--simd") && moreargs) {
+                opt_simd = argv[++j];
+            } else if (!strcmp(argv[j],"--headless")) {
+                opt_headless = 1;
+            } else if (!strcmp(argv[j],"--fps") && moreargs) {
+                opt_fps = atoi(argv[++j]);
+            } else if (!strcmp(argv[j],"--pyramid") && moreargs) {
+                opt_pyramid = atoi(argv[++j]);
+            } else if (!strcmp(argv[j],"--level-generations") && moreargs) {
+                opt_level_generations = argv[++j];
+            } else if (!strcmp(argv[j],"--level-plateau") && moreargs) {
+                opt_level_plateau = argv[++j];
+            } else if (!strcmp(argv[j],"--checkpoint-interval") && moreargs) {
+                opt_checkpoint_interval = parseInterval(argv[++j]);
+                if (opt_checkpoint_interval == -1) {
+                    fprintf(stderr,"Invalid checkpoint interval.");
+                    showHelp(argv[0]);
+                }
+            } else if (!strcmp(argv[j],"--stats") && moreargs) {
+                opt_stats = argv[++j];
+            } else if (!strcmp(argv[j],"--stats-interval") && moreargs) {
+                opt_stats_interval = parseInterval(argv[++j]);
+                if (opt_stats_interval == -1) {
+                    fprintf(stderr,"Invalid statistics interval.");
+                    showHelp(argv[0]);
+                }
+            } else if (!strcmp(argv[j],"--journal") && moreargs) {
+                opt_journal = argv[++j];
+            } else if (!strcmp(argv[j],"--journal-max-size") && moreargs) {
+                opt_journal_max_size = strtoll(argv[++j],NULL,10);
+            } else if (!strcmp(argv[j],"--journal-dump")) {
+                opt_journal_dump = 1;
+            } else if (!strcmp(argv[j],"--islands") && moreargs) {
+                opt_islands = atoi(argv[++j]);
+            } else if (!strcmp(argv[j],"--migration-interval") && moreargs) {
+                opt_migration_interval = strtoll(argv[++j],NULL,10);
+            } else if (!strcmp(argv[j],"--seed") && moreargs) {
+                opt_seed = strtoull(argv[++j],NULL,10);
+                opt_seed_given = 1;
+            } else if (!strcmp(argv[j],"--bench") && moreargs) {
+                opt_bench = atoi(argv[++j]);
+            } else if (!strcmp(argv[j],"--jobs") && moreargs) {
+                opt_jobs = atoi(argv[++j]);
+            } else if (!strcmp(argv[j],"--target-diff") && moreargs) {
+                opt_target_diff = atof(argv[++j]);
+            } else if (!strcmp(argv[j],"--time-budget") && moreargs) {
+                opt_time_budget = parseInterval(argv[++j]);
+                if (opt_time_budget == -1) {
+                    fprintf(stderr,"Invalid time budget.");
+                    showHelp(argv[0]);
+                }
+            } else if (!strcmp(argv[j],"--max-size") && moreargs) {
+                opt_max_size = atoi(argv[++j]);
+            } else if (!strcmp(argv[j],"--sequence")) {
+                opt_sequence = 1;
+            } else if (!strcmp(argv[j],"--first-frame") && moreargs) {
+                opt_first_frame = atoi(argv[++j]);
+            } else if (!strcmp(argv[j],"--frame-generations") && moreargs) {
+                opt_frame_generations = strtoll(argv[++j],NULL,10);
+            } else if (!strcmp(argv[j],"--tiles") && moreargs) {
+                opt_tiles = atoi(argv[++j]);
+            } else if (!strcmp(argv[j],"--tile-overlap") && moreargs) {
+                opt_tile_overlap = atoi(argv[++j]);
             } else if (!strcmp(argv[j],"--restart")) {
                 opt_restart = 1;
             } else if (!strcmp(argv[j],"--help")) {
@@ -799,126 +4913,96 @@ int main(int argc, char **argv)
         state.max_shapes = state.max_shapes_incremental;
     if (opt_mutation_rate > 1000)
         opt_mutation_rate = 1000;
-
-    /* Load the PNG in memory. */
-    fp = fopen(argv[1],"rb");
-    if (!fp) {
-        perror("Opening PNG file");
-        exit(1);
+    if (opt_threads < 1)
+        opt_threads = 1;
+    if (opt_band_threads < 1)
+        opt_band_threads = 1;
+    if (opt_band_threads > MAX_BAND_THREADS)
+        opt_band_threads = MAX_BAND_THREADS;
+    if (opt_pyramid < 1)
+        opt_pyramid = 1;
+    if (listValue(opt_level_generations,0) == -1 ||
+        listValue(opt_level_plateau,0) == -1)
+    {
+        fprintf(stderr,"Invalid list of values per level.");
+        showHelp(argv[0]);
     }
-    if ((image = PngLoad(fp,&width,&height,&alpha)) == NULL) {
-        printf("Can't load the specified image.");
+    if (opt_bench < 0)
+        opt_bench = 0;
+    if (opt_islands < 1)
+        opt_islands = 1;
+    if (opt_migration_interval < 1)
+        opt_migration_interval = 1;
+    if (opt_bench) {
+        /* Benchmarks must be reproducible and not measure I/O. */
+        if (!opt_seed_given) opt_seed = 1;
+        opt_seed_given = 1;
+        opt_headless = 1;
+        opt_restart = 1;
+    }
+    if (selectKernels(opt_simd) == -1) {
+        fprintf(stderr,"SIMD level '%s' not available.\n", opt_simd);
         exit(1);
     }
+    printf("Using the %s diff kernel and the %s span kernel\n",
+        diffKernelName, spanKernelName);
+    if (!opt_seed_given)
+        opt_seed = ((unsigned long long)time(NULL) << 20) ^ ustime() ^ getpid();
 
-    printf("Image %d %d, alpha:%d at %p\n", width, height, alpha, image);
-    fclose(fp);
-
-    /* Initialize SDL and allocate our arrays of triangles. */
-    texture = sdlInit(width,height,0,&renderer);
-    fb = malloc(width*height*3);
-    triangles = mkRandomtriangles(state.max_shapes,width,height);
-    best = mkRandomtriangles(state.max_shapes,width,height);
-    absbest = mkRandomtriangles(state.max_shapes,width,height);
-    state.absbestdiff = bestdiff = 100;
-
-    /* Load the binary file if any. */
-    if (!opt_restart) {
-        loadBinary(argv[2],best);
+    if (opt_schedule == SCHEDULE_TIME) {
+        opt_halflife_value = opt_halflife ? parseInterval(opt_halflife) : 60000;
     } else {
-        best->inuse = state.max_shapes_incremental;
+        opt_halflife_value = opt_halflife ? strtoll(opt_halflife,NULL,10) :
+                                            20000;
     }
-    absbest->inuse = best->inuse;
-    memcpy(absbest->triangles,best->triangles,
-        sizeof(struct triangle)*best->count);
-
-    /* Show the current evolved image and the real image for one scond each. */
-    memset(fb,0,width*height*3);
-    drawtriangles(fb,width,height,best);
-    sdlShowRgb(texture,renderer,fb,width,height);
-    sleep(1);
-    sdlShowRgb(texture,renderer,image,width,height);
-    sleep(1);
-
-    /* Evolve the current solution using simulated annealing. */
-    while(1) {
-        state.generation++;
-        if (state.temperature > 0 && !(state.generation % 10)) {
-            state.temperature -= 0.00001;
-            if (state.temperature < 0) state.temperature = 0;
-        }
-
-        /* From time to time allow the current solution to use one more
-         * triangle, up to the configured max number. */
-        if ((state.generation % 1000) == 0) {
-            if (state.max_shapes_incremental < triangles->count &&
-                triangles->inuse > state.max_shapes_incremental-1)
-            {
-                state.max_shapes_incremental++;
-            }
+    if (opt_halflife_value <= 0) {
+        fprintf(stderr,"Invalid halflife.");
+        showHelp(argv[0]);
+    }
+    if (opt_plateau_generations < 0)
+        opt_plateau_generations = 0;
+    if (opt_tiles < 0)
+        opt_tiles = 0;
+    if (opt_tile_overlap < 0)
+        opt_tile_overlap = 0;
+    if (opt_tiles && !opt_batch && strcmp(argv[2],"-")) {
+        fprintf(stderr,"The binary file can't represent the stitched tiles, "
+                       "in tiled mode pass - as its name.\n");
+        exit(1);
+    }
+    if (opt_sequence && !opt_batch &&
+        (opt_stats || opt_islands > 1 || opt_bench || opt_journal ||
+         opt_pyramid > 1))
+    {
+        fprintf(stderr,"--stats, --islands, --bench, --journal and --pyramid "
+                       "can't be used in sequence mode.\n");
+        exit(1);
+    }
+    if (opt_batch || opt_tiles) {
+        if (opt_stats || opt_islands > 1 || opt_bench || opt_journal) {
+            fprintf(stderr,"--stats, --islands, --bench and --journal can't "
+                           "be used in batch and tiled modes.\n");
+            exit(1);
         }
-
-        /* Copy what is currenly the best solution, and mutate it. */
-        memcpy(triangles->triangles,best->triangles,
-            sizeof(struct triangle)*best->count);
-        triangles->inuse = best->inuse;
-        mutatetriangles(triangles,10,width,height);
-
-        /* Draw the mutated solution, and check what is its fitness.
-         * In our case the fitness is the difference bewteen the target
-         * image and our image. */
-        memset(fb,0,width*height*3);
-        drawtriangles(fb,width,height,triangles);
-        diff = computeDiff(image,fb,width,height);
-
-        /* The percentage of difference is calculate taking the ratio between
-         * the maximum difference and the current difference.
-         * The magic constant 422 is actually the max difference between
-         * two pixels as r,g,b coordinates in the space, so sqrt(255^2*3). */
-        percdiff = (float)diff/(width*height*442)*100;
-        if (percdiff < bestdiff ||
-            (state.temperature > 0 &&
-             ((float)rand()/RAND_MAX) < state.temperature &&
-             (percdiff-state.absbestdiff) < 2*state.temperature))
-        {
-            /* Save what is currently our "best" solution, even if actually
-             * this may be a jump backward depending on the temperature.
-             * It will be used as a base of the next iteration. */
-            best->inuse = triangles->inuse;
-            memcpy(best->triangles,triangles->triangles,
-                sizeof(struct triangle)*best->count);
-
-            if (percdiff < bestdiff) {
-                /* We always save a copy of the absolute best solution we found
-                 * so far, after some generation without finding anything better
-                 * we may jump back to that solution.
-                 *
-                 * We also use the absolute best solution to save the program
-                 * state in the binary file, and as SVG output. */
-                absbest->inuse = best->inuse;
-                memcpy(absbest->triangles,best->triangles,
-                    sizeof(struct triangle)*best->count);
-                state.absbestdiff = percdiff;
-            }
-
-            printf("Diff is %f%% (inuse:%d, max:%d, gen:%lld, temp:%f)\n",
-                percdiff,
-                triangles->inuse,
-                state.max_shapes_incremental,
-                state.generation,
-                state.temperature);
-
-            bestdiff = percdiff;
-            sdlShowRgb(texture,renderer,fb,width,height);
+        if (opt_target_diff <= 0 && opt_time_budget <= 0) {
+            fprintf(stderr,"Batch and tiled modes require --target-diff or "
+                           "--time-budget.\n");
+            exit(1);
         }
-        processSdlEvents();
-
-        /* From time to time save the current state into a binary save
-         * and produce an SVG of the current solution. */
-        if ((state.generation % 100) == 0) {
-            saveSvg(argv[3],absbest,width,height);
-            saveBinary(argv[2],absbest);
+        if (opt_jobs < 1) {
+            opt_jobs = sysconf(_SC_NPROCESSORS_ONLN)/opt_threads;
+            if (opt_jobs < 1) opt_jobs = 1;
         }
     }
-    return 0;
+
+    /* SDL must be used by the main thread, so while the viewer is shown the
+     * evolution runs in its own thread. The batch and tiled modes have
+     * no window. */
+    viewer = (opt_headless || opt_batch || opt_tiles) ? NULL :
+                                                       viewerCreate(opt_fps);
+    args.argv = argv;
+    args.viewer = viewer;
+    viewerRun(viewer,shapemeThread,&args);
+    viewerFree(viewer);
+    return args.retval;
 }